@@ -62,7 +62,7 @@ static void whisper_context_finalizer(SEXP ctx_) {
 // Parse the model file and create the whisper context
 //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
 //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
-SEXP whisper_init_(SEXP path_, SEXP verbose_) {
+SEXP whisper_init_(SEXP path_, SEXP verbose_, SEXP kv_q8_) {
   
   const char *path = CHAR(STRING_ELT(path_, 0));
 
@@ -75,6 +75,11 @@ SEXP whisper_init_(SEXP path_, SEXP verbose_) {
     error("Failed to create whisper context");
   }
   
+  if (asLogical(kv_q8_) && whisper_set_kv_cross_q8(ctx, true) != 0) {
+    whisper_free(ctx);
+    error("Failed to allocate the quantized cross-attention cache");
+  }
+  
   
   //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
   SEXP ctx_ = R_MakeExternalPtr(ctx, R_NilValue, R_NilValue);
@@ -90,6 +95,145 @@ SEXP whisper_init_(SEXP path_, SEXP verbose_) {
 
 
 
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Set the size of the mel/encoder cache for repeated audio
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+SEXP whisper_cache_(SEXP ctx_, SEXP n_mel_, SEXP n_encode_) {
+  
+  struct whisper_context *ctx = external_ptr_to_whisper_context(ctx_);
+  
+  whisper_set_cache(ctx, asInteger(n_mel_), asInteger(n_encode_));
+  
+  return R_NilValue;
+}
+
+
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Save/load the encoder output of the last processed window
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+SEXP whisper_encode_save_(SEXP ctx_, SEXP file_) {
+  
+  struct whisper_context *ctx = external_ptr_to_whisper_context(ctx_);
+  
+  if (whisper_encode_save(ctx, CHAR(STRING_ELT(file_, 0))) != 0) {
+    error("Whisper failed to save the encoder output\n");
+  }
+  
+  return R_NilValue;
+}
+
+SEXP whisper_encode_load_(SEXP ctx_, SEXP file_) {
+  
+  struct whisper_context *ctx = external_ptr_to_whisper_context(ctx_);
+  
+  if (whisper_encode_load(ctx, CHAR(STRING_ELT(file_, 0))) != 0) {
+    error("Whisper failed to load the encoder output\n");
+  }
+  
+  return R_NilValue;
+}
+
+
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Run only the encoder and return its hidden states as audio features
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+SEXP whisper_encode_features_(SEXP ctx_, SEXP snd_, SEXP layer_, SEXP pool_, SEXP audio_ctx_, SEXP n_threads_) {
+  
+  struct whisper_context *ctx = external_ptr_to_whisper_context(ctx_);
+  
+  const int n_threads = asInteger(n_threads_);
+  const int audio_ctx = asInteger(audio_ctx_);
+  
+  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+  // Convert 'double' to 'float' for whisper.cpp and compute the spectrogram
+  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+  double *snd = REAL(snd_);
+  float *fsnd = (float *)malloc(length(snd_) * sizeof(float));
+  if (fsnd == NULL) {
+    error("Could not allocate memory for 'fsnd'");
+  }
+  
+  for (int i = 0; i < length(snd_); i++) {
+    fsnd[i] = snd[i];
+  }
+  
+  int res = whisper_pcm_to_mel(ctx, fsnd, length(snd_), n_threads);
+  free(fsnd);
+  if (res != 0) {
+    error("Whisper failed to compute the spectrogram\n");
+  }
+  
+  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+  // The encoder output is left in the whisper state as [n_ctx][n_state] 
+  // floats and read from there straight into the R result
+  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+  const int n_state = whisper_model_n_audio_state(ctx);
+  
+  const int n_ctx = whisper_encode_features(ctx, 0, asInteger(layer_), audio_ctx, NULL, n_threads);
+  if (n_ctx < 0) {
+    error("Whisper failed to encode audio\n");
+  }
+  
+  // Only keep the positions which cover the audio (2 spectrogram frames each)
+  int n_rows = (whisper_n_len(ctx) + 1) / 2;
+  if (n_rows > n_ctx) {
+    n_rows = n_ctx;
+  }
+  if (n_rows < 1) {
+    error("Audio is too short\n");
+  }
+  
+  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+  // Fill the R result: [n_rows, n_state] matrix or mean over rows
+  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+  const float *feat = whisper_get_features(ctx);
+  
+  SEXP res_;
+  if (asLogical(pool_)) {
+    res_ = PROTECT(allocVector(REALSXP, n_state));
+    double *out = REAL(res_);
+    
+    for (int j = 0; j < n_state; j++) {
+      out[j] = 0;
+    }
+    for (int i = 0; i < n_rows; i++) {
+      const float *row = feat + (size_t)i * n_state;
+      for (int j = 0; j < n_state; j++) {
+        out[j] += row[j];
+      }
+    }
+    for (int j = 0; j < n_state; j++) {
+      out[j] /= n_rows;
+    }
+  } else {
+    res_ = PROTECT(allocMatrix(REALSXP, n_rows, n_state));
+    double *out = REAL(res_);
+    
+    for (int i = 0; i < n_rows; i++) {
+      const float *row = feat + (size_t)i * n_state;
+      for (int j = 0; j < n_state; j++) {
+        out[i + (size_t)j * n_rows] = row[j];
+      }
+    }
+  }
+  
+  UNPROTECT(1);
+  return res_;
+}
+
+
+
+
 //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
 //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
 // Main whisper routine
@@ -134,7 +278,18 @@ SEXP whisper_(SEXP ctx_, SEXP snd_, SEXP params_, SEXP details_) {
   wparams.translate        = asLogical  (VECTOR_ELT(params_, 1));
   wparams.language         = CHAR(asChar(VECTOR_ELT(params_, 2)));
   wparams.max_len          = asInteger  (VECTOR_ELT(params_, 3));
-  wparams.detect_language  = asLogical  (VECTOR_ELT(params_, 4));
+  wparams.audio_ctx        = asInteger  (VECTOR_ELT(params_, 4));
+  wparams.n_threads_ahead  = asInteger  (VECTOR_ELT(params_, 5));
+  wparams.stem_reuse       = asLogical  (VECTOR_ELT(params_, 6));
+  if (!isNull(VECTOR_ELT(params_, 7))) {
+    wparams.draft_ctx      = external_ptr_to_whisper_context(VECTOR_ELT(params_, 7));
+  }
+  wparams.draft_n_tokens   = asInteger  (VECTOR_ELT(params_, 8));
+  if (!isNull(VECTOR_ELT(params_, 9))) {
+    wparams.allowed_tokens   = INTEGER(VECTOR_ELT(params_, 9));
+    wparams.n_allowed_tokens = length(VECTOR_ELT(params_, 9));
+  }
+  wparams.detect_language  = asLogical  (VECTOR_ELT(params_, 10));
   wparams.token_timestamps = true;
   
   
@@ -106,6 +106,9 @@ typedef void* thread_ret_t;
 
 #define GGML_SOFT_MAX_UNROLL 4
 #define GGML_VEC_DOT_UNROLL  2
+#define GGML_CONV_BLOCK      32 // outputs per cache block in the fused conv_1d kernels
+#define GGML_VEC_DOT_HEAD    64 // attention head width shared by all whisper models
+#define GGML_VEC_DOT_TILE    2  // columns per tile in the f16 mul_mat kernel for rows of whole GGML_F16_STEPs
 
 #ifdef GGML_USE_ACCELERATE
 // uncomment to use vDSP for soft max computation
@@ -3219,6 +3222,76 @@ inline static void ggml_vec_dot_f16_unroll(const int n, const int xs, float * re
     }
 }
 
+// dot product of one row of GGML_VEC_DOT_HEAD elements with nc contiguous rows of y
+// the row is converted once and kept in registers for all of y - with the width fixed
+// at compile time the inner loop is fully unrolled and there are no leftovers
+// ss - stride of s in floats
+inline static void ggml_vec_dot_f16_head(const int nc, float * restrict s, const int ss, ggml_fp16_t * restrict x, ggml_fp16_t * restrict y) {
+#if defined(GGML_SIMD)
+    GGML_F16_VEC ax[GGML_VEC_DOT_HEAD/GGML_F16_EPR];
+
+    for (int j = 0; j < GGML_VEC_DOT_HEAD/GGML_F16_EPR; j++) {
+        ax[j] = GGML_F16_VEC_LOAD(x + j*GGML_F16_EPR, j);
+    }
+
+    for (int ic = 0; ic < nc; ++ic) {
+        ggml_fp16_t * restrict yc = y + ic*GGML_VEC_DOT_HEAD;
+
+        GGML_F16_VEC sum[GGML_F16_ARR] = { GGML_F16_VEC_ZERO };
+
+        for (int j = 0; j < GGML_VEC_DOT_HEAD/GGML_F16_EPR; j++) {
+            sum[j%GGML_F16_ARR] = GGML_F16_VEC_FMA(sum[j%GGML_F16_ARR], ax[j], GGML_F16_VEC_LOAD(yc + j*GGML_F16_EPR, j));
+        }
+
+        ggml_float sumf = 0.0;
+        GGML_F16_VEC_REDUCE(sumf, sum);
+
+        s[ic*ss] = sumf;
+    }
+#else
+    for (int ic = 0; ic < nc; ++ic) {
+        ggml_vec_dot_f16(GGML_VEC_DOT_HEAD, s + ic*ss, x, y + ic*GGML_VEC_DOT_HEAD);
+    }
+#endif
+}
+
+// dot products of one row of x with GGML_VEC_DOT_TILE contiguous rows of y, n a multiple of GGML_F16_STEP
+// (all n_state widths of the whisper models) - each loaded chunk of x is reused for the whole tile and
+// every column keeps the accumulators of ggml_vec_dot_f16(), so the results are the same
+// ss - stride of s in floats
+inline static void ggml_vec_dot_f16_tile(const int n, float * restrict s, const int ss, ggml_fp16_t * restrict x, ggml_fp16_t * restrict y) {
+#if defined(GGML_SIMD)
+    GGML_F16_VEC sum[GGML_VEC_DOT_TILE][GGML_F16_ARR];
+
+    for (int ic = 0; ic < GGML_VEC_DOT_TILE; ++ic) {
+        for (int j = 0; j < GGML_F16_ARR; j++) {
+            sum[ic][j] = GGML_F16_VEC_ZERO;
+        }
+    }
+
+    for (int i = 0; i < n; i += GGML_F16_STEP) {
+        for (int j = 0; j < GGML_F16_ARR; j++) {
+            const GGML_F16_VEC ax = GGML_F16_VEC_LOAD(x + i + j*GGML_F16_EPR, j);
+
+            for (int ic = 0; ic < GGML_VEC_DOT_TILE; ++ic) {
+                sum[ic][j] = GGML_F16_VEC_FMA(sum[ic][j], ax, GGML_F16_VEC_LOAD(y + ic*n + i + j*GGML_F16_EPR, j));
+            }
+        }
+    }
+
+    for (int ic = 0; ic < GGML_VEC_DOT_TILE; ++ic) {
+        ggml_float sumf = 0.0;
+        GGML_F16_VEC_REDUCE(sumf, sum[ic]);
+
+        s[ic*ss] = sumf;
+    }
+#else
+    for (int ic = 0; ic < GGML_VEC_DOT_TILE; ++ic) {
+        ggml_vec_dot_f16(n, s + ic*ss, x, y + ic*n);
+    }
+#endif
+}
+
 inline static void ggml_vec_mad_f32(const int n, float * restrict y, const float * restrict x, const float v) {
 #if defined(GGML_SIMD)
     const int np = (n & ~(GGML_F32_STEP - 1));
@@ -3280,6 +3353,96 @@ inline static void ggml_vec_scale_f32(const int n, float * y, const float   v) {
 #endif
 }
 
+// y = (x - mean(x))/sqrt(var(x) + eps)*w + b
+// one pass for the mean, one for the variance and one for the output - the row stays in cache
+inline static void ggml_vec_norm_affine_f32(const int n, float * y, const float * x, const float * w, const float * b, const float eps) {
+    ggml_float sum  = 0.0;
+    ggml_float sum2 = 0.0;
+
+#if defined(GGML_SIMD)
+    const int np = (n & ~(GGML_F32_STEP - 1));
+
+    GGML_F32_VEC ax[GGML_F32_ARR];
+    GGML_F32_VEC ay[GGML_F32_ARR];
+
+    {
+        GGML_F32_VEC vs[GGML_F32_ARR] = { GGML_F32_VEC_ZERO };
+
+        for (int i = 0; i < np; i += GGML_F32_STEP) {
+            for (int j = 0; j < GGML_F32_ARR; j++) {
+                ax[j] = GGML_F32_VEC_LOAD(x + i + j*GGML_F32_EPR);
+                vs[j] = GGML_F32_VEC_ADD(vs[j], ax[j]);
+            }
+        }
+
+        GGML_F32_VEC_REDUCE(sum, vs);
+
+        for (int i = np; i < n; ++i) {
+            sum += (ggml_float)x[i];
+        }
+    }
+
+    const float mean = sum/n;
+
+    {
+        GGML_F32_VEC vm = GGML_F32_VEC_SET1(-mean);
+        GGML_F32_VEC vs[GGML_F32_ARR] = { GGML_F32_VEC_ZERO };
+
+        for (int i = 0; i < np; i += GGML_F32_STEP) {
+            for (int j = 0; j < GGML_F32_ARR; j++) {
+                ax[j] = GGML_F32_VEC_ADD(GGML_F32_VEC_LOAD(x + i + j*GGML_F32_EPR), vm);
+                vs[j] = GGML_F32_VEC_FMA(vs[j], ax[j], ax[j]);
+            }
+        }
+
+        GGML_F32_VEC_REDUCE(sum2, vs);
+
+        for (int i = np; i < n; ++i) {
+            const float v = x[i] - mean;
+            sum2 += (ggml_float)(v*v);
+        }
+    }
+
+    const float scale = 1.0f/sqrtf(sum2/n + eps);
+
+    {
+        // (x - mean)*scale = x*scale - mean*scale
+        GGML_F32_VEC vscale = GGML_F32_VEC_SET1(scale);
+        GGML_F32_VEC vshift = GGML_F32_VEC_SET1(-mean*scale);
+
+        for (int i = 0; i < np; i += GGML_F32_STEP) {
+            for (int j = 0; j < GGML_F32_ARR; j++) {
+                ax[j] = GGML_F32_VEC_FMA(vshift, GGML_F32_VEC_LOAD(x + i + j*GGML_F32_EPR), vscale);
+                ay[j] = GGML_F32_VEC_FMA(GGML_F32_VEC_LOAD(b + i + j*GGML_F32_EPR), ax[j], GGML_F32_VEC_LOAD(w + i + j*GGML_F32_EPR));
+
+                GGML_F32_VEC_STORE(y + i + j*GGML_F32_EPR, ay[j]);
+            }
+        }
+
+        for (int i = np; i < n; ++i) {
+            y[i] = (x[i] - mean)*scale*w[i] + b[i];
+        }
+    }
+#else
+    for (int i = 0; i < n; ++i) {
+        sum += (ggml_float)x[i];
+    }
+
+    const float mean = sum/n;
+
+    for (int i = 0; i < n; ++i) {
+        const float v = x[i] - mean;
+        sum2 += (ggml_float)(v*v);
+    }
+
+    const float scale = 1.0f/sqrtf(sum2/n + eps);
+
+    for (int i = 0; i < n; ++i) {
+        y[i] = (x[i] - mean)*scale*w[i] + b[i];
+    }
+#endif
+}
+
 inline static void ggml_vec_norm_f32 (const int n, float * s, const float * x) { ggml_vec_dot_f32(n, s, x, x); *s = sqrtf(*s);   }
 inline static void ggml_vec_sqr_f32  (const int n, float * y, const float * x) { for (int i = 0; i < n; ++i) y[i] = x[i]*x[i];   }
 inline static void ggml_vec_sqrt_f32 (const int n, float * y, const float * x) { for (int i = 0; i < n; ++i) y[i] = sqrtf(x[i]); }
@@ -3524,10 +3687,13 @@ static const char * GGML_OP_LABEL[GGML_OP_COUNT] = {
     "SILU",
     "SILU_BACK",
     "NORM",
+    "NORM_AFFINE",
     "RMS_NORM",
     "RMS_NORM_BACK",
 
     "MUL_MAT",
+    "MUL_MAT_BIAS",
+    "MUL_MAT_BIAS_GELU",
 
     "SCALE",
     "SET",
@@ -3549,6 +3715,8 @@ static const char * GGML_OP_LABEL[GGML_OP_COUNT] = {
     "CLAMP",
     "CONV_1D_1S",
     "CONV_1D_2S",
+    "CONV_1D_1S_GELU",
+    "CONV_1D_2S_GELU",
 
     "FLASH_ATTN",
     "FLASH_FF",
@@ -3557,7 +3725,7 @@ static const char * GGML_OP_LABEL[GGML_OP_COUNT] = {
     "MAP_BINARY",
 };
 
-static_assert(GGML_OP_COUNT == 51, "GGML_OP_COUNT != 51");
+static_assert(GGML_OP_COUNT == 56, "GGML_OP_COUNT != 56");
 
 
 // static const char * GGML_OP_SYMBOL[GGML_OP_COUNT] = {
@@ -3586,10 +3754,13 @@ static_assert(GGML_OP_COUNT == 51, "GGML_OP_COUNT != 51");
 //     "silu(x)",
 //     "silu_back(x)",
 //     "norm(x)",
+//     "norm(x)*w+b",
 //     "rms_norm(x)",
 //     "rms_norm_back(x)",
 // 
 //     "X*Y",
+//     "X*Y+b",
+//     "gelu(X*Y+b)",
 // 
 //     "x*v",
 //     "y-\\>view(x)",
@@ -3611,6 +3782,8 @@ static_assert(GGML_OP_COUNT == 51, "GGML_OP_COUNT != 51");
 //     "clamp(x)",
 //     "conv_1d_1s(x)",
 //     "conv_1d_2s(x)",
+//     "conv_1d_1s_gelu(x)",
+//     "conv_1d_2s_gelu(x)",
 // 
 //     "flash_attn(x)",
 //     "flash_ff(x)",
@@ -3619,7 +3792,7 @@ static_assert(GGML_OP_COUNT == 51, "GGML_OP_COUNT != 51");
 //     "f(x,y)",
 // };
 
-static_assert(GGML_OP_COUNT == 51, "GGML_OP_COUNT != 51");
+static_assert(GGML_OP_COUNT == 56, "GGML_OP_COUNT != 56");
 
 static_assert(sizeof(struct ggml_object)%GGML_MEM_ALIGN == 0, "ggml_object size must be a multiple of GGML_MEM_ALIGN");
 static_assert(sizeof(struct ggml_tensor)%GGML_MEM_ALIGN == 0, "ggml_tensor size must be a multiple of GGML_MEM_ALIGN");
@@ -4021,6 +4194,10 @@ size_t ggml_set_scratch(struct ggml_context * ctx, struct ggml_scratch scratch)
     return result;
 }
 
+void ggml_set_no_alloc(struct ggml_context * ctx, bool no_alloc) {
+    ctx->no_alloc = no_alloc;
+}
+
 // IMPORTANT:
 // when creating "opt" tensors, always save and load the scratch buffer
 // this is an error prone process, but it is necessary to support inplace
@@ -5323,6 +5500,33 @@ struct ggml_tensor * ggml_norm_inplace(
     return ggml_norm_impl(ctx, a, true);
 }
 
+// ggml_norm_affine
+
+struct ggml_tensor * ggml_norm_affine(
+        struct ggml_context * ctx,
+        struct ggml_tensor  * a,
+        struct ggml_tensor  * w,
+        struct ggml_tensor  * b) {
+    GGML_ASSERT(ggml_is_contiguous(w) && w->type == GGML_TYPE_F32 && ggml_nelements(w) == a->ne[0]);
+    GGML_ASSERT(ggml_is_contiguous(b) && b->type == GGML_TYPE_F32 && ggml_nelements(b) == a->ne[0]);
+    bool is_node = false;
+
+    if (a->grad || w->grad || b->grad) {
+        GGML_ASSERT(false); // TODO: implement backward
+        is_node = true;
+    }
+
+    struct ggml_tensor * result = ggml_dup_tensor(ctx, a);
+
+    result->op     = GGML_OP_NORM_AFFINE;
+    result->grad   = is_node ? ggml_dup_tensor(ctx, result) : NULL;
+    result->src0   = a;
+    result->src1   = w;
+    result->opt[0] = b;
+
+    return result;
+}
+
 struct ggml_tensor * ggml_rms_norm_impl(
         struct ggml_context * ctx,
         struct ggml_tensor  * a,
@@ -5403,6 +5607,67 @@ struct ggml_tensor * ggml_mul_mat(
     return result;
 }
 
+// ggml_mul_mat_bias
+
+static struct ggml_tensor * ggml_mul_mat_bias_impl(
+        struct ggml_context * ctx,
+        struct ggml_tensor  * a,
+        struct ggml_tensor  * b,
+        struct ggml_tensor  * c,
+        struct ggml_tensor  * s,
+        bool gelu) {
+    GGML_ASSERT(ggml_can_mul_mat(a, b));
+    GGML_ASSERT(!ggml_is_transposed(a));
+    GGML_ASSERT(ggml_is_contiguous(c));
+    GGML_ASSERT(c->type == GGML_TYPE_F32);
+    GGML_ASSERT(ggml_nelements(c) == a->ne[1]);
+    GGML_ASSERT(s == NULL || (ggml_is_scalar(s) && s->type == GGML_TYPE_F32));
+
+    bool is_node = false;
+
+    if (a->grad || b->grad || c->grad) {
+        GGML_ASSERT(false); // TODO: implement backward
+        is_node = true;
+    }
+
+    const int64_t ne[4] = { a->ne[1], b->ne[1], a->ne[2], b->ne[3] };
+    struct ggml_tensor * result = ggml_new_tensor(ctx, GGML_TYPE_F32, MIN(a->n_dims, b->n_dims), ne);
+
+    result->op     = gelu ? GGML_OP_MUL_MAT_BIAS_GELU : GGML_OP_MUL_MAT_BIAS;
+    result->grad   = is_node ? ggml_dup_tensor(ctx, result) : NULL;
+    result->src0   = a;
+    result->src1   = b;
+    result->opt[0] = c;
+    result->opt[1] = s;
+
+    return result;
+}
+
+struct ggml_tensor * ggml_mul_mat_bias(
+        struct ggml_context * ctx,
+        struct ggml_tensor  * a,
+        struct ggml_tensor  * b,
+        struct ggml_tensor  * c) {
+    return ggml_mul_mat_bias_impl(ctx, a, b, c, NULL, false);
+}
+
+struct ggml_tensor * ggml_mul_mat_bias_scale(
+        struct ggml_context * ctx,
+        struct ggml_tensor  * a,
+        struct ggml_tensor  * b,
+        struct ggml_tensor  * c,
+        struct ggml_tensor  * s) {
+    return ggml_mul_mat_bias_impl(ctx, a, b, c, s, false);
+}
+
+struct ggml_tensor * ggml_mul_mat_bias_gelu(
+        struct ggml_context * ctx,
+        struct ggml_tensor  * a,
+        struct ggml_tensor  * b,
+        struct ggml_tensor  * c) {
+    return ggml_mul_mat_bias_impl(ctx, a, b, c, NULL, true);
+}
+
 // ggml_scale
 
 struct ggml_tensor * ggml_scale_impl(
@@ -6013,6 +6278,31 @@ struct ggml_tensor * ggml_get_rows(
     return result;
 }
 
+// ggml_get_rows_raw
+
+struct ggml_tensor * ggml_get_rows_raw(
+        struct ggml_context * ctx,
+        struct ggml_tensor  * a,
+        struct ggml_tensor  * b) {
+    GGML_ASSERT(ggml_is_matrix(a) && ggml_is_vector(b) && b->type == GGML_TYPE_I32);
+
+    bool is_node = false;
+
+    if (a->grad || b->grad) {
+        GGML_ASSERT(false); // TODO: implement backward
+        is_node = true;
+    }
+
+    struct ggml_tensor * result = ggml_new_tensor_2d(ctx, a->type, a->ne[0], b->ne[0]);
+
+    result->op   = GGML_OP_GET_ROWS;
+    result->grad = is_node ? ggml_dup_tensor(ctx, result) : NULL;
+    result->src0 = a;
+    result->src1 = b;
+
+    return result;
+}
+
 // ggml_get_rows_back
 
 struct ggml_tensor * ggml_get_rows_back(
@@ -6412,6 +6702,57 @@ struct ggml_tensor * ggml_conv_1d_2s(
     return result;
 }
 
+// ggml_conv_1d_1s_gelu
+
+static struct ggml_tensor * ggml_conv_1d_gelu_impl(
+        struct ggml_context * ctx,
+        struct ggml_tensor  * a,
+        struct ggml_tensor  * b,
+        struct ggml_tensor  * c,
+        int                   s) {
+    GGML_ASSERT(ggml_is_matrix(b));
+    GGML_ASSERT(a->ne[1] == b->ne[1]);
+    GGML_ASSERT(a->ne[3] == 1);
+    GGML_ASSERT(ggml_is_contiguous(c));
+    GGML_ASSERT(c->type == GGML_TYPE_F32);
+    GGML_ASSERT(ggml_nelements(c) == a->ne[2]);
+    bool is_node = false;
+
+    if (a->grad || b->grad || c->grad) {
+        GGML_ASSERT(false); // TODO: implement backward
+        is_node = true;
+    }
+
+    const int64_t ne[4] = { b->ne[0]/s, a->ne[2], 1, 1, };
+    struct ggml_tensor * result = ggml_new_tensor(ctx, GGML_TYPE_F32, 2, ne);
+
+    result->op     = s == 1 ? GGML_OP_CONV_1D_1S_GELU : GGML_OP_CONV_1D_2S_GELU;
+    result->grad   = is_node ? ggml_dup_tensor(ctx, result) : NULL;
+    result->src0   = a;
+    result->src1   = b;
+    result->opt[0] = c;
+
+    return result;
+}
+
+struct ggml_tensor * ggml_conv_1d_1s_gelu(
+        struct ggml_context * ctx,
+        struct ggml_tensor  * a,
+        struct ggml_tensor  * b,
+        struct ggml_tensor  * c) {
+    return ggml_conv_1d_gelu_impl(ctx, a, b, c, 1);
+}
+
+// ggml_conv_1d_2s_gelu
+
+struct ggml_tensor * ggml_conv_1d_2s_gelu(
+        struct ggml_context * ctx,
+        struct ggml_tensor  * a,
+        struct ggml_tensor  * b,
+        struct ggml_tensor  * c) {
+    return ggml_conv_1d_gelu_impl(ctx, a, b, c, 2);
+}
+
 // ggml_flash_attn
 
 struct ggml_tensor * ggml_flash_attn(
@@ -9169,6 +9510,79 @@ static void ggml_compute_forward_norm(
     }
 }
 
+// ggml_compute_forward_norm_affine
+
+static void ggml_compute_forward_norm_affine_f32(
+        const struct ggml_compute_params * params,
+        const struct ggml_tensor * src0,
+        const struct ggml_tensor * src1,
+        const struct ggml_tensor * opt0,
+        struct ggml_tensor * dst) {
+    GGML_ASSERT(ggml_are_same_shape(src0, dst));
+
+    if (params->type == GGML_TASK_INIT || params->type == GGML_TASK_FINALIZE) {
+        return;
+    }
+
+    GGML_ASSERT(src0->nb[0] == sizeof(float));
+    GGML_ASSERT(dst->nb[0]  == sizeof(float));
+
+    const int ith = params->ith;
+    const int nth = params->nth;
+
+    const int64_t ne00 = src0->ne[0];
+    const int64_t ne01 = src0->ne[1];
+    const int64_t ne02 = src0->ne[2];
+
+    const size_t nb01 = src0->nb[1];
+    const size_t nb02 = src0->nb[2];
+    const size_t nb03 = src0->nb[3];
+
+    const size_t nb1 = dst->nb[1];
+    const size_t nb2 = dst->nb[2];
+    const size_t nb3 = dst->nb[3];
+
+    const float eps = 1e-5f; // TODO: make this a parameter
+
+    const float * w = (float *) src1->data;
+    const float * b = (float *) opt0->data;
+
+    // rows per thread
+    const int nr  = ggml_nrows(src0);
+    const int dr  = (nr + nth - 1)/nth;
+    const int ir0 = dr*ith;
+    const int ir1 = MIN(ir0 + dr, nr);
+
+    for (int ir = ir0; ir < ir1; ++ir) {
+        const int i03 = ir/(ne02*ne01);
+        const int i02 = (ir - i03*ne02*ne01)/ne01;
+        const int i01 = (ir - i03*ne02*ne01 - i02*ne01);
+
+        ggml_vec_norm_affine_f32(ne00,
+                (float *) ((char *) dst->data  + i01*nb1  + i02*nb2  + i03*nb3),
+                (float *) ((char *) src0->data + i01*nb01 + i02*nb02 + i03*nb03),
+                w, b, eps);
+    }
+}
+
+static void ggml_compute_forward_norm_affine(
+        const struct ggml_compute_params * params,
+        const struct ggml_tensor * src0,
+        const struct ggml_tensor * src1,
+        const struct ggml_tensor * opt0,
+        struct ggml_tensor * dst) {
+    switch (src0->type) {
+        case GGML_TYPE_F32:
+            {
+                ggml_compute_forward_norm_affine_f32(params, src0, src1, opt0, dst);
+            } break;
+        default:
+            {
+                GGML_ASSERT(false);
+            } break;
+    }
+}
+
 static void ggml_compute_forward_rms_norm_f32(
         const struct ggml_compute_params * params,
         const struct ggml_tensor * src0,
@@ -9463,6 +9877,49 @@ static bool ggml_compute_forward_mul_mat_use_blas(
 }
 #endif
 
+// epilogue of GGML_OP_MUL_MAT_BIAS and GGML_OP_MUL_MAT_BIAS_GELU for the outputs of src0 rows [ir0, ir1)
+// adds the bias of the row (opt[0]), then applies the scale (opt[1], if any) and the GELU
+// called right after the dot products of the rows, while the outputs are still in cache
+static void ggml_compute_forward_mul_mat_epilogue(
+        struct ggml_tensor * dst,
+        const int ir0,
+        const int ir1) {
+    if (dst->op == GGML_OP_MUL_MAT) {
+        return;
+    }
+
+    const int64_t ne0 = dst->ne[0];
+    const int64_t ne1 = dst->ne[1];
+    const int64_t ne2 = dst->ne[2];
+
+    const size_t nb0 = dst->nb[0];
+    const size_t nb1 = dst->nb[1];
+    const size_t nb2 = dst->nb[2];
+    const size_t nb3 = dst->nb[3];
+
+    const float * bias  = (const float *) dst->opt[0]->data;
+    const float   scale = dst->opt[1] ? *(const float *) dst->opt[1]->data : 1.0f;
+    const bool    gelu  = dst->op == GGML_OP_MUL_MAT_BIAS_GELU;
+
+    for (int ir = ir0; ir < ir1; ++ir) {
+        const int i3 = ir/(ne2*ne0);
+        const int i2 = (ir - i3*ne2*ne0)/ne0;
+        const int i0 = (ir - i3*ne2*ne0 - i2*ne0);
+
+        char * d = (char *) dst->data + i0*nb0 + i2*nb2 + i3*nb3;
+
+        for (int64_t i1 = 0; i1 < ne1; ++i1) {
+            float * y = (float *) (d + i1*nb1);
+
+            *y = (*y + bias[i0])*scale;
+
+            if (gelu) {
+                ggml_vec_gelu_f32(1, y, y);
+            }
+        }
+    }
+}
+
 static void ggml_compute_forward_mul_mat_f32(
         const struct ggml_compute_params * params,
         const struct ggml_tensor * src0,
@@ -9537,6 +9994,7 @@ static void ggml_compute_forward_mul_mat_f32(
     if (ggml_cuda_can_mul_mat(src0, src1, dst)) {
         if (params->ith == 0 && params->type == GGML_TASK_COMPUTE) {
             ggml_cuda_mul_mat(src0, src1, dst, params->wdata, params->wsize);
+            ggml_compute_forward_mul_mat_epilogue(dst, 0, ne01*ne02*ne03);
         }
         return;
     }
@@ -9581,6 +10039,8 @@ static void ggml_compute_forward_mul_mat_f32(
         }
         //printf("CBLAS F32 = %f ms, %d x %d x %d x %d\n", (ggml_perf_time_us() - t0)/1000.0, ne0, ne1, ne2, ne3);
 
+        ggml_compute_forward_mul_mat_epilogue(dst, 0, ne01*ne02*ne03);
+
         return;
     }
 #endif
@@ -9628,6 +10088,8 @@ static void ggml_compute_forward_mul_mat_f32(
                     (float *) ((char *) src0->data + (i01*nb01 + i02*nb02 + i03*nb03)),
                     (float *) ((char *) src1->data + (i11*nb11 + i12*nb12 + i13*nb13)));
         }
+
+        ggml_compute_forward_mul_mat_epilogue(dst, ir, ir + 1);
     }
 
     //int64_t t1 = ggml_perf_time_us();
@@ -9712,6 +10174,7 @@ static void ggml_compute_forward_mul_mat_f16_f32(
     if (ggml_cuda_can_mul_mat(src0, src1, dst)) {
         if (params->ith == 0 && params->type == GGML_TASK_COMPUTE) {
             ggml_cuda_mul_mat(src0, src1, dst, params->wdata, params->wsize);
+            ggml_compute_forward_mul_mat_epilogue(dst, 0, ne01*ne02*ne03);
         }
         return;
     }
@@ -9778,6 +10241,8 @@ static void ggml_compute_forward_mul_mat_f16_f32(
 
         /*printf("CBLAS F16 = %f ms, %d x %d x %d x %d\n", (ggml_perf_time_us() - t0)/1000.0, ne0, ne1, ne2, ne3);*/
 
+        ggml_compute_forward_mul_mat_epilogue(dst, 0, ne01*ne02*ne03);
+
         return;
     }
 #endif
@@ -9841,9 +10306,25 @@ static void ggml_compute_forward_mul_mat_f16_f32(
 
         float * dst_col = (float *) ((char *) dst->data + (i0*nb0 + 0*nb1 + i2*nb2 + i3*nb3));
 
-        for (int64_t ic = 0; ic < ne11; ++ic) {
-            ggml_vec_dot_f16(ne00, &dst_col[ic*ne0], src0_row, src1_col + ic*ne00);
+        if (ne00 == GGML_VEC_DOT_HEAD) {
+            ggml_vec_dot_f16_head(ne11, dst_col, ne0, src0_row, src1_col);
+        } else {
+            int64_t ic = 0;
+
+#if defined(GGML_SIMD)
+            if (ne00 % GGML_F16_STEP == 0) {
+                for (; ic + GGML_VEC_DOT_TILE <= ne11; ic += GGML_VEC_DOT_TILE) {
+                    ggml_vec_dot_f16_tile(ne00, &dst_col[ic*ne0], ne0, src0_row, src1_col + ic*ne00);
+                }
+            }
+#endif
+
+            for (; ic < ne11; ++ic) {
+                ggml_vec_dot_f16(ne00, &dst_col[ic*ne0], src0_row, src1_col + ic*ne00);
+            }
         }
+
+        ggml_compute_forward_mul_mat_epilogue(dst, ir, ir + 1);
     }
 
     //int64_t t1 = ggml_time_us();
@@ -9932,6 +10413,7 @@ static void ggml_compute_forward_mul_mat_q_f32(
     if (ggml_cuda_can_mul_mat(src0, src1, dst)) {
         if (params->ith == 0 && params->type == GGML_TASK_COMPUTE) {
             ggml_cuda_mul_mat(src0, src1, dst, params->wdata, params->wsize);
+            ggml_compute_forward_mul_mat_epilogue(dst, 0, ne01*ne02*ne03);
         }
         return;
     }
@@ -9996,6 +10478,8 @@ static void ggml_compute_forward_mul_mat_q_f32(
 
         //printf("CBLAS = %f ms, %d x %d x %d x %d\n", (ggml_perf_time_us() - t0)/1000.0, ne0, ne1, ne2, ne3);
 
+        ggml_compute_forward_mul_mat_epilogue(dst, 0, ne01*ne02*ne03);
+
         return;
     }
 #endif
@@ -10058,6 +10542,8 @@ static void ggml_compute_forward_mul_mat_q_f32(
         for (int64_t ic = 0; ic < ne11; ++ic) {
             vec_dot_q(ne00, &dst_col[ic*ne0], src0_row, (void *) (src1_col + ic*row_size));
         }
+
+        ggml_compute_forward_mul_mat_epilogue(dst, ir, ir + 1);
     }
 
     //int64_t t1 = ggml_time_us();
@@ -10337,36 +10823,44 @@ static void ggml_compute_forward_transpose(
 
 // ggml_compute_forward_get_rows
 
-static void ggml_compute_forward_get_rows_q(
+// the rows are copied as they are (dst has the type of src0) - the rows are split between the threads
+static void ggml_compute_forward_get_rows_raw(
         const struct ggml_compute_params * params,
         const struct ggml_tensor * src0,
         const struct ggml_tensor * src1,
               struct ggml_tensor * dst) {
-    assert(params->ith == 0);
-
     if (params->type == GGML_TASK_INIT || params->type == GGML_TASK_FINALIZE) {
         return;
     }
 
     const int nc = src0->ne[0];
     const int nr = ggml_nelements(src1);
-    const enum ggml_type type = src0->type;
-    dequantize_row_q_t const dequantize_row_q = quantize_fns[type].dequantize_row_q;
 
     assert( dst->ne[0] == nc);
     assert( dst->ne[1] == nr);
-    assert(src0->nb[0] == GGML_TYPE_SIZE[type]);
+    assert( dst->type  == src0->type);
+    assert(src0->nb[0] == GGML_TYPE_SIZE[src0->type]);
 
-    for (int i = 0; i < nr; ++i) {
+    const size_t row_size = (nc/GGML_BLCK_SIZE[src0->type])*GGML_TYPE_SIZE[src0->type];
+
+    const int ith = params->ith;
+    const int nth = params->nth;
+
+    // rows per thread
+    const int dr = (nr + nth - 1)/nth;
+
+    // row range for this thread
+    const int ir0 = dr*ith;
+    const int ir1 = MIN(ir0 + dr, nr);
+
+    for (int i = ir0; i < ir1; ++i) {
         const int r = ((int32_t *) src1->data)[i];
 
-        dequantize_row_q(
-                (const void *) ((char *) src0->data + r*src0->nb[1]),
-                     (float *) ((char *)  dst->data + i*dst->nb[1]), nc);
+        memcpy((char *) dst->data + i*dst->nb[1], (char *) src0->data + r*src0->nb[1], row_size);
     }
 }
 
-static void ggml_compute_forward_get_rows_f16(
+static void ggml_compute_forward_get_rows_q(
         const struct ggml_compute_params * params,
         const struct ggml_tensor * src0,
         const struct ggml_tensor * src1,
@@ -10379,22 +10873,23 @@ static void ggml_compute_forward_get_rows_f16(
 
     const int nc = src0->ne[0];
     const int nr = ggml_nelements(src1);
+    const enum ggml_type type = src0->type;
+    dequantize_row_q_t const dequantize_row_q = quantize_fns[type].dequantize_row_q;
 
     assert( dst->ne[0] == nc);
     assert( dst->ne[1] == nr);
-    assert(src0->nb[0] == sizeof(ggml_fp16_t));
+    assert(src0->nb[0] == GGML_TYPE_SIZE[type]);
 
     for (int i = 0; i < nr; ++i) {
         const int r = ((int32_t *) src1->data)[i];
 
-        for (int j = 0; j < nc; ++j) {
-            ggml_fp16_t v = ((ggml_fp16_t *) ((char *) src0->data + r*src0->nb[1]))[j];
-            ((float *) ((char *)  dst->data + i*dst->nb[1]))[j] = GGML_FP16_TO_FP32(v);
-        }
+        dequantize_row_q(
+                (const void *) ((char *) src0->data + r*src0->nb[1]),
+                     (float *) ((char *)  dst->data + i*dst->nb[1]), nc);
     }
 }
 
-static void ggml_compute_forward_get_rows_f32(
+static void ggml_compute_forward_get_rows_f16(
         const struct ggml_compute_params * params,
         const struct ggml_tensor * src0,
         const struct ggml_tensor * src1,
@@ -10410,14 +10905,15 @@ static void ggml_compute_forward_get_rows_f32(
 
     assert( dst->ne[0] == nc);
     assert( dst->ne[1] == nr);
-    assert(src0->nb[0] == sizeof(float));
+    assert(src0->nb[0] == sizeof(ggml_fp16_t));
 
     for (int i = 0; i < nr; ++i) {
         const int r = ((int32_t *) src1->data)[i];
 
-        ggml_vec_cpy_f32(nc,
-                (float *) ((char *)  dst->data + i*dst->nb[1]),
-                (float *) ((char *) src0->data + r*src0->nb[1]));
+        for (int j = 0; j < nc; ++j) {
+            ggml_fp16_t v = ((ggml_fp16_t *) ((char *) src0->data + r*src0->nb[1]))[j];
+            ((float *) ((char *)  dst->data + i*dst->nb[1]))[j] = GGML_FP16_TO_FP32(v);
+        }
     }
 }
 
@@ -10426,6 +10922,11 @@ static void ggml_compute_forward_get_rows(
         const struct ggml_tensor * src0,
         const struct ggml_tensor * src1,
         struct ggml_tensor * dst) {
+    if (dst->type == src0->type) {
+        ggml_compute_forward_get_rows_raw(params, src0, src1, dst);
+        return;
+    }
+
     switch (src0->type) {
         case GGML_TYPE_Q4_0:
         case GGML_TYPE_Q4_1:
@@ -10440,10 +10941,6 @@ static void ggml_compute_forward_get_rows(
             {
                 ggml_compute_forward_get_rows_f16(params, src0, src1, dst);
             } break;
-        case GGML_TYPE_F32:
-            {
-                ggml_compute_forward_get_rows_f32(params, src0, src1, dst);
-            } break;
         default:
             {
                 GGML_ASSERT(false);
@@ -12084,6 +12581,255 @@ static void ggml_compute_forward_conv_1d_2s(
     }
 }
 
+// ggml_compute_forward_conv_1d_gelu
+
+// the kernel is stored as [ne02][nk][ew0] and the zero-padded input as [nh + ne10 + nh][ew0], so the receptive field
+// of output i0 is the contiguous block of nk*ew0 values at row s*i0 (im2col without the copy) and each output row is
+// a GEMV against it. bias and gelu are applied to the row before moving on to the next one
+static void ggml_compute_forward_conv_1d_gelu_f16_f32(
+        const struct ggml_compute_params * params,
+        const struct ggml_tensor * src0,
+        const struct ggml_tensor * src1,
+        const struct ggml_tensor * opt0,
+              struct ggml_tensor * dst,
+        const int s) {
+    GGML_ASSERT(src0->type == GGML_TYPE_F16);
+    GGML_ASSERT(src1->type == GGML_TYPE_F32);
+    GGML_ASSERT( dst->type == GGML_TYPE_F32);
+
+    int64_t t0 = ggml_perf_time_us();
+    UNUSED(t0);
+
+    const int64_t ne00 = src0->ne[0];
+    const int64_t ne01 = src0->ne[1];
+    const int64_t ne02 = src0->ne[2];
+
+    const int64_t ne10 = src1->ne[0];
+    const int64_t ne11 = src1->ne[1];
+
+    const int64_t ne0  = dst->ne[0];
+
+    const int nb00 = src0->nb[0];
+    const int nb01 = src0->nb[1];
+    const int nb02 = src0->nb[2];
+
+    const int nb10 = src1->nb[0];
+    const int nb11 = src1->nb[1];
+
+    const int nb1  = dst->nb[1];
+
+    const int ith = params->ith;
+    const int nth = params->nth;
+
+    const int nk = ne00;
+    const int nh = nk/2;
+
+    const int ew0 = ggml_up32(ne01);
+
+    GGML_ASSERT(ne00 % 2 == 1); // TODO: support even kernel sizes
+    GGML_ASSERT(nb00 == sizeof(ggml_fp16_t));
+    GGML_ASSERT(nb10 == sizeof(float));
+
+    ggml_fp16_t * const wk = (ggml_fp16_t *) params->wdata + 0;
+    ggml_fp16_t * const wx = (ggml_fp16_t *) params->wdata + ne02*ew0*ne00;
+
+    if (params->type == GGML_TASK_INIT) {
+        // only the padding has to be zero, but clear just the region in use rather than all of wsize
+        memset(params->wdata, 0, sizeof(ggml_fp16_t)*(ne02*ew0*ne00 + (ne10 + 2*nh)*ew0));
+
+        // prepare kernel data (src0)
+        for (int64_t i02 = 0; i02 < ne02; i02++) {
+            for (int64_t i01 = 0; i01 < ne01; i01++) {
+                const ggml_fp16_t * const src = (ggml_fp16_t *)((char *) src0->data + i02*nb02 + i01*nb01);
+                ggml_fp16_t * dst_data = wk + i02*ew0*ne00;
+                for (int64_t i00 = 0; i00 < ne00; i00++) {
+                    dst_data[i00*ew0 + i01] = src[i00];
+                }
+            }
+        }
+
+        // prepare source data (src1)
+        for (int64_t i11 = 0; i11 < ne11; i11++) {
+            const float * const src = (float *)((char *) src1->data + i11*nb11);
+            for (int64_t i10 = 0; i10 < ne10; i10++) {
+                wx[(i10 + nh)*ew0 + i11] = GGML_FP32_TO_FP16(src[i10]);
+            }
+        }
+
+        return;
+    }
+
+    if (params->type == GGML_TASK_FINALIZE) {
+        return;
+    }
+
+    const float * bias = (const float *) opt0->data;
+
+    // total rows in dst
+    const int nr = ne02;
+
+    // rows per thread
+    const int dr = (nr + nth - 1)/nth;
+
+    // row range for this thread
+    const int ir0 = dr*ith;
+    const int ir1 = MIN(ir0 + dr, nr);
+
+    const int n  = nk*ew0;
+    const int xs = s*ew0*sizeof(ggml_fp16_t);
+
+    // block over the outputs so that the input tile stays in cache while it is reused by all rows of this thread
+    for (int64_t ib = 0; ib < ne0; ib += GGML_CONV_BLOCK) {
+        const int64_t ie = MIN(ib + GGML_CONV_BLOCK, ne0);
+
+        for (int i1 = ir0; i1 < ir1; i1++) {
+            float * dst_data = (float *)((char *) dst->data + i1*nb1);
+            ggml_fp16_t * k = wk + i1*ew0*ne00;
+
+            // GGML_VEC_DOT_UNROLL outputs share each load of the kernel row
+            int64_t i0 = ib;
+            for (; i0 + GGML_VEC_DOT_UNROLL <= ie; i0 += GGML_VEC_DOT_UNROLL) {
+                ggml_vec_dot_f16_unroll(n, xs, dst_data + i0, wx + s*i0*ew0, k);
+            }
+            for (; i0 < ie; ++i0) {
+                ggml_vec_dot_f16(n, dst_data + i0, wx + s*i0*ew0, k);
+            }
+
+            ggml_vec_acc1_f32(ie - ib, dst_data + ib, bias[i1]);
+            ggml_vec_gelu_f32(ie - ib, dst_data + ib, dst_data + ib);
+        }
+    }
+}
+
+static void ggml_compute_forward_conv_1d_gelu_f32(
+        const struct ggml_compute_params * params,
+        const struct ggml_tensor * src0,
+        const struct ggml_tensor * src1,
+        const struct ggml_tensor * opt0,
+              struct ggml_tensor * dst,
+        const int s) {
+    GGML_ASSERT(src0->type == GGML_TYPE_F32);
+    GGML_ASSERT(src1->type == GGML_TYPE_F32);
+    GGML_ASSERT( dst->type == GGML_TYPE_F32);
+
+    int64_t t0 = ggml_perf_time_us();
+    UNUSED(t0);
+
+    const int64_t ne00 = src0->ne[0];
+    const int64_t ne01 = src0->ne[1];
+    const int64_t ne02 = src0->ne[2];
+
+    const int64_t ne10 = src1->ne[0];
+    const int64_t ne11 = src1->ne[1];
+
+    const int64_t ne0  = dst->ne[0];
+
+    const int nb00 = src0->nb[0];
+    const int nb01 = src0->nb[1];
+    const int nb02 = src0->nb[2];
+
+    const int nb10 = src1->nb[0];
+    const int nb11 = src1->nb[1];
+
+    const int nb1  = dst->nb[1];
+
+    const int ith = params->ith;
+    const int nth = params->nth;
+
+    const int nk = ne00;
+    const int nh = nk/2;
+
+    const int ew0 = ggml_up32(ne01);
+
+    GGML_ASSERT(ne00 % 2 == 1); // TODO: support even kernel sizes
+    GGML_ASSERT(nb00 == sizeof(float));
+    GGML_ASSERT(nb10 == sizeof(float));
+
+    float * const wk = (float *) params->wdata + 0;
+    float * const wx = (float *) params->wdata + ne02*ew0*ne00;
+
+    if (params->type == GGML_TASK_INIT) {
+        memset(params->wdata, 0, sizeof(float)*(ne02*ew0*ne00 + (ne10 + 2*nh)*ew0));
+
+        // prepare kernel data (src0)
+        for (int64_t i02 = 0; i02 < ne02; i02++) {
+            for (int64_t i01 = 0; i01 < ne01; i01++) {
+                const float * const src = (float *)((char *) src0->data + i02*nb02 + i01*nb01);
+                float * dst_data = wk + i02*ew0*ne00;
+                for (int64_t i00 = 0; i00 < ne00; i00++) {
+                    dst_data[i00*ew0 + i01] = src[i00];
+                }
+            }
+        }
+
+        // prepare source data (src1)
+        for (int64_t i11 = 0; i11 < ne11; i11++) {
+            const float * const src = (float *)((char *) src1->data + i11*nb11);
+            for (int64_t i10 = 0; i10 < ne10; i10++) {
+                wx[(i10 + nh)*ew0 + i11] = src[i10];
+            }
+        }
+
+        return;
+    }
+
+    if (params->type == GGML_TASK_FINALIZE) {
+        return;
+    }
+
+    const float * bias = (const float *) opt0->data;
+
+    // total rows in dst
+    const int nr = ne02;
+
+    // rows per thread
+    const int dr = (nr + nth - 1)/nth;
+
+    // row range for this thread
+    const int ir0 = dr*ith;
+    const int ir1 = MIN(ir0 + dr, nr);
+
+    const int n = nk*ew0;
+
+    for (int64_t ib = 0; ib < ne0; ib += GGML_CONV_BLOCK) {
+        const int64_t ie = MIN(ib + GGML_CONV_BLOCK, ne0);
+
+        for (int i1 = ir0; i1 < ir1; i1++) {
+            float * dst_data = (float *)((char *) dst->data + i1*nb1);
+
+            for (int64_t i0 = ib; i0 < ie; ++i0) {
+                ggml_vec_dot_f32(n, dst_data + i0, wx + s*i0*ew0, wk + i1*ew0*ne00);
+            }
+
+            ggml_vec_acc1_f32(ie - ib, dst_data + ib, bias[i1]);
+            ggml_vec_gelu_f32(ie - ib, dst_data + ib, dst_data + ib);
+        }
+    }
+}
+
+static void ggml_compute_forward_conv_1d_gelu(
+        const struct ggml_compute_params * params,
+        const struct ggml_tensor * src0,
+        const struct ggml_tensor * src1,
+        const struct ggml_tensor * opt0,
+        struct ggml_tensor * dst,
+        const int s) {
+    switch (src0->type) {
+        case GGML_TYPE_F16:
+            {
+                ggml_compute_forward_conv_1d_gelu_f16_f32(params, src0, src1, opt0, dst, s);
+            } break;
+        case GGML_TYPE_F32:
+            {
+                ggml_compute_forward_conv_1d_gelu_f32(params, src0, src1, opt0, dst, s);
+            } break;
+        default:
+            {
+                GGML_ASSERT(false);
+            } break;
+    }
+}
+
 // ggml_compute_forward_flash_attn
 
 static void ggml_compute_forward_flash_attn_f32(
@@ -12961,6 +13707,10 @@ static void ggml_compute_forward(struct ggml_compute_params * params, struct ggm
             {
                 ggml_compute_forward_norm(params, tensor->src0, tensor);
             } break;
+        case GGML_OP_NORM_AFFINE:
+            {
+                ggml_compute_forward_norm_affine(params, tensor->src0, tensor->src1, tensor->opt[0], tensor);
+            } break;
         case GGML_OP_RMS_NORM:
             {
                 ggml_compute_forward_rms_norm(params, tensor->src0, tensor);
@@ -12970,6 +13720,8 @@ static void ggml_compute_forward(struct ggml_compute_params * params, struct ggm
                 ggml_compute_forward_rms_norm_back(params, tensor->src0, tensor->src1, tensor);
             } break;
         case GGML_OP_MUL_MAT:
+        case GGML_OP_MUL_MAT_BIAS:
+        case GGML_OP_MUL_MAT_BIAS_GELU:
             {
                 ggml_compute_forward_mul_mat(params, tensor->src0, tensor->src1, tensor);
             } break;
@@ -13053,6 +13805,14 @@ static void ggml_compute_forward(struct ggml_compute_params * params, struct ggm
             {
                 ggml_compute_forward_conv_1d_2s(params, tensor->src0, tensor->src1, tensor);
             } break;
+        case GGML_OP_CONV_1D_1S_GELU:
+            {
+                ggml_compute_forward_conv_1d_gelu(params, tensor->src0, tensor->src1, tensor->opt[0], tensor, 1);
+            } break;
+        case GGML_OP_CONV_1D_2S_GELU:
+            {
+                ggml_compute_forward_conv_1d_gelu(params, tensor->src0, tensor->src1, tensor->opt[0], tensor, 2);
+            } break;
         case GGML_OP_FLASH_ATTN:
             {
                 int32_t t = ggml_get_i32_1d(tensor->opt[1], 0);
@@ -13371,6 +14131,7 @@ static void ggml_compute_backward(struct ggml_context * ctx, struct ggml_tensor
                 GGML_ASSERT(false); // TODO: not implemented
             } break;
         case GGML_OP_NORM:
+        case GGML_OP_NORM_AFFINE:
             {
                 GGML_ASSERT(false); // TODO: not implemented
             } break;
@@ -13439,6 +14200,11 @@ static void ggml_compute_backward(struct ggml_context * ctx, struct ggml_tensor
                                 inplace);
                 }
             } break;
+        case GGML_OP_MUL_MAT_BIAS:
+        case GGML_OP_MUL_MAT_BIAS_GELU:
+            {
+                GGML_ASSERT(false); // TODO: not implemented
+            } break;
         case GGML_OP_SCALE:
             {
                 // necessary for llama
@@ -13747,6 +14513,8 @@ static void ggml_compute_backward(struct ggml_context * ctx, struct ggml_tensor
                 GGML_ASSERT(false); // TODO: not implemented
             } break;
         case GGML_OP_CONV_1D_2S:
+        case GGML_OP_CONV_1D_1S_GELU:
+        case GGML_OP_CONV_1D_2S_GELU:
             {
                 GGML_ASSERT(false); // TODO: not implemented
             } break;
@@ -13774,6 +14542,23 @@ static void ggml_compute_backward(struct ggml_context * ctx, struct ggml_tensor
     }
 }
 
+// mark node as visited, returns true if it already was
+// a linear scan over nodes/leafs made graph construction quadratic in the graph size
+static bool ggml_graph_visit(struct ggml_cgraph * cgraph, struct ggml_tensor * node) {
+    size_t i = (size_t) ((uintptr_t) node >> 4) % GGML_GRAPH_HASHSIZE;
+
+    while (cgraph->visited[i] != NULL) {
+        if (cgraph->visited[i] == node) {
+            return true;
+        }
+        i = (i + 1) % GGML_GRAPH_HASHSIZE;
+    }
+
+    cgraph->visited[i] = node;
+
+    return false;
+}
+
 static void ggml_visit_parents(struct ggml_cgraph * cgraph, struct ggml_tensor * node) {
     if (node->grad == NULL) {
         // this usually happens when we generate intermediate nodes from constants in the backward pass
@@ -13784,16 +14569,8 @@ static void ggml_visit_parents(struct ggml_cgraph * cgraph, struct ggml_tensor *
     }
 
     // check if already visited
-    for (int i = 0; i < cgraph->n_nodes; i++) {
-        if (cgraph->nodes[i] == node) {
-            return;
-        }
-    }
-
-    for (int i = 0; i < cgraph->n_leafs; i++) {
-        if (cgraph->leafs[i] == node) {
-            return;
-        }
+    if (ggml_graph_visit(cgraph, node)) {
+        return;
     }
 
     if (node->src0) {
@@ -13829,6 +14606,7 @@ static void ggml_build_forward_impl(struct ggml_cgraph * cgraph, struct ggml_ten
     if (!expand) {
         cgraph->n_nodes = 0;
         cgraph->n_leafs = 0;
+        memset(cgraph->visited, 0, sizeof(cgraph->visited));
     }
 
     const int n0 = cgraph->n_nodes;
@@ -13859,6 +14637,7 @@ struct ggml_cgraph ggml_build_forward(struct ggml_tensor * tensor) {
         /*.nodes        =*/ { NULL },
         /*.grads        =*/ { NULL },
         /*.leafs        =*/ { NULL },
+        /*.visited      =*/ { NULL },
         /*.perf_runs    =*/ 0,
         /*.perf_cycles  =*/ 0,
         /*.perf_time_us =*/ 0,
@@ -14144,12 +14923,15 @@ void ggml_graph_compute(struct ggml_context * ctx, struct ggml_cgraph * cgraph)
                 case GGML_OP_SILU:
                 case GGML_OP_SILU_BACK:
                 case GGML_OP_NORM:
+                case GGML_OP_NORM_AFFINE:
                 case GGML_OP_RMS_NORM:
                 case GGML_OP_RMS_NORM_BACK:
                     {
                         node->n_tasks = n_threads;
                     } break;
                 case GGML_OP_MUL_MAT:
+                case GGML_OP_MUL_MAT_BIAS:
+                case GGML_OP_MUL_MAT_BIAS_GELU:
                     {
                         node->n_tasks = n_threads;
 
@@ -14217,13 +14999,17 @@ void ggml_graph_compute(struct ggml_context * ctx, struct ggml_cgraph * cgraph)
                 case GGML_OP_VIEW:
                 case GGML_OP_PERMUTE:
                 case GGML_OP_TRANSPOSE:
-                case GGML_OP_GET_ROWS:
                 case GGML_OP_GET_ROWS_BACK:
                 case GGML_OP_DIAG:
                 case GGML_OP_DIAG_MASK_ZERO:
                     {
                         node->n_tasks = 1;
                     } break;
+                case GGML_OP_GET_ROWS:
+                    {
+                        // only copying rows (see ggml_compute_forward_get_rows_raw) is split between the threads
+                        node->n_tasks = node->type == node->src0->type ? n_threads : 1;
+                    } break;
                 case GGML_OP_DIAG_MASK_INF:
                 case GGML_OP_SOFT_MAX:
                 case GGML_OP_ROPE:
@@ -14241,6 +15027,8 @@ void ggml_graph_compute(struct ggml_context * ctx, struct ggml_cgraph * cgraph)
                     } break;
                 case GGML_OP_CONV_1D_1S:
                 case GGML_OP_CONV_1D_2S:
+                case GGML_OP_CONV_1D_1S_GELU:
+                case GGML_OP_CONV_1D_2S_GELU:
                     {
                         node->n_tasks = n_threads;
 
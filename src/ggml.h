@@ -195,6 +195,7 @@
 
 #define GGML_MAX_DIMS          4
 #define GGML_MAX_NODES         4096
+#define GGML_GRAPH_HASHSIZE    8273 // prime > 2*GGML_MAX_NODES
 #define GGML_MAX_PARAMS        256
 #define GGML_MAX_CONTEXTS      64
 #define GGML_MAX_OPT           4
@@ -290,10 +291,13 @@ extern "C" {
         GGML_OP_SILU,
         GGML_OP_SILU_BACK,
         GGML_OP_NORM, // normalize
+        GGML_OP_NORM_AFFINE,
         GGML_OP_RMS_NORM,
         GGML_OP_RMS_NORM_BACK,
 
         GGML_OP_MUL_MAT,
+        GGML_OP_MUL_MAT_BIAS,
+        GGML_OP_MUL_MAT_BIAS_GELU,
 
         GGML_OP_SCALE,
         GGML_OP_SET,
@@ -315,6 +319,8 @@ extern "C" {
         GGML_OP_CLAMP,
         GGML_OP_CONV_1D_1S,
         GGML_OP_CONV_1D_2S,
+        GGML_OP_CONV_1D_1S_GELU,
+        GGML_OP_CONV_1D_2S_GELU,
 
         GGML_OP_FLASH_ATTN,
         GGML_OP_FLASH_FF,
@@ -388,6 +394,9 @@ extern "C" {
         struct ggml_tensor * grads[GGML_MAX_NODES];
         struct ggml_tensor * leafs[GGML_MAX_NODES];
 
+        // open-addressing set of the nodes and leafs visited so far
+        struct ggml_tensor * visited[GGML_GRAPH_HASHSIZE];
+
         // performance
         int     perf_runs;
         int64_t perf_cycles;
@@ -443,6 +452,7 @@ extern "C" {
     GGML_API size_t  ggml_used_mem(const struct ggml_context * ctx);
 
     GGML_API size_t  ggml_set_scratch(struct ggml_context * ctx, struct ggml_scratch scratch);
+    GGML_API void    ggml_set_no_alloc(struct ggml_context * ctx, bool no_alloc);
 
     GGML_API struct ggml_tensor * ggml_new_tensor(
             struct ggml_context * ctx,
@@ -634,6 +644,14 @@ extern "C" {
             struct ggml_context * ctx,
             struct ggml_tensor  * a);
 
+    // normalize along rows, then multiply by w and add b (both with a->ne[0] elements)
+    // same as ggml_add(ggml_mul(ggml_norm(a), ggml_repeat(w)), ggml_repeat(b)) without the intermediate tensors
+    GGML_API struct ggml_tensor * ggml_norm_affine(
+            struct ggml_context * ctx,
+            struct ggml_tensor  * a,
+            struct ggml_tensor  * w,
+            struct ggml_tensor  * b);
+
     GGML_API struct ggml_tensor * ggml_rms_norm(
             struct ggml_context * ctx,
             struct ggml_tensor  * a);
@@ -653,6 +671,29 @@ extern "C" {
             struct ggml_tensor  * a,
             struct ggml_tensor  * b);
 
+    // ggml_mul_mat(a, b) + c, where c has one element per row of a (i.e. one per result column)
+    // the bias is added right after each dot product - no repeated copy of c is needed
+    GGML_API struct ggml_tensor * ggml_mul_mat_bias(
+            struct ggml_context * ctx,
+            struct ggml_tensor  * a,
+            struct ggml_tensor  * b,
+            struct ggml_tensor  * c);
+
+    // (ggml_mul_mat(a, b) + c)*s, where s is a scalar
+    GGML_API struct ggml_tensor * ggml_mul_mat_bias_scale(
+            struct ggml_context * ctx,
+            struct ggml_tensor  * a,
+            struct ggml_tensor  * b,
+            struct ggml_tensor  * c,
+            struct ggml_tensor  * s);
+
+    // gelu(ggml_mul_mat(a, b) + c)
+    GGML_API struct ggml_tensor * ggml_mul_mat_bias_gelu(
+            struct ggml_context * ctx,
+            struct ggml_tensor  * a,
+            struct ggml_tensor  * b,
+            struct ggml_tensor  * c);
+
     //
     // operations on tensors without backpropagation
     //
@@ -820,6 +861,12 @@ extern "C" {
             struct ggml_tensor  * a,
             struct ggml_tensor  * b);
 
+    // same as ggml_get_rows, but the rows are copied without conversion (the result has the type of a)
+    GGML_API struct ggml_tensor * ggml_get_rows_raw(
+            struct ggml_context * ctx,
+            struct ggml_tensor  * a,
+            struct ggml_tensor  * b);
+
     GGML_API struct ggml_tensor * ggml_get_rows_back(
             struct ggml_context * ctx,
             struct ggml_tensor  * a,
@@ -922,6 +969,20 @@ extern "C" {
             struct ggml_tensor  * a,
             struct ggml_tensor  * b);
 
+    // gelu(conv_1d(a, b) + c), c holds one bias per output channel
+    // the bias and activation are applied while the output rows are still in cache
+    GGML_API struct ggml_tensor * ggml_conv_1d_1s_gelu(
+            struct ggml_context * ctx,
+            struct ggml_tensor  * a,
+            struct ggml_tensor  * b,
+            struct ggml_tensor  * c);
+
+    GGML_API struct ggml_tensor * ggml_conv_1d_2s_gelu(
+            struct ggml_context * ctx,
+            struct ggml_tensor  * a,
+            struct ggml_tensor  * b,
+            struct ggml_tensor  * c);
+
     GGML_API struct ggml_tensor * ggml_flash_attn(
             struct ggml_context * ctx,
             struct ggml_tensor  * q,
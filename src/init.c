@@ -4,14 +4,22 @@
 #include <Rinternals.h>
 
 extern SEXP record_audio_(SEXP seconds_);
-extern SEXP whisper_init_(SEXP path_);
+extern SEXP whisper_init_(SEXP path_, SEXP verbose_, SEXP kv_q8_);
 extern SEXP whisper_(SEXP ctx_, SEXP snd_, SEXP params_);
+extern SEXP whisper_cache_(SEXP ctx_, SEXP n_mel_, SEXP n_encode_);
+extern SEXP whisper_encode_save_(SEXP ctx_, SEXP file_);
+extern SEXP whisper_encode_load_(SEXP ctx_, SEXP file_);
+extern SEXP whisper_encode_features_(SEXP ctx_, SEXP snd_, SEXP layer_, SEXP pool_, SEXP audio_ctx_, SEXP n_threads_);
 
 static const R_CallMethodDef CEntries[] = {
   
-  {"record_audio_"   , (DL_FUNC) &record_audio_   , 1},
-  {"whisper_init_"   , (DL_FUNC) &whisper_init_   , 2},
-  {"whisper_"        , (DL_FUNC) &whisper_        , 4},
+  {"record_audio_"            , (DL_FUNC) &record_audio_            , 1},
+  {"whisper_init_"            , (DL_FUNC) &whisper_init_            , 3},
+  {"whisper_"                 , (DL_FUNC) &whisper_                 , 4},
+  {"whisper_cache_"           , (DL_FUNC) &whisper_cache_           , 3},
+  {"whisper_encode_save_"     , (DL_FUNC) &whisper_encode_save_     , 2},
+  {"whisper_encode_load_"     , (DL_FUNC) &whisper_encode_load_     , 2},
+  {"whisper_encode_features_" , (DL_FUNC) &whisper_encode_features_ , 6},
   {NULL , NULL, 0}
 };
 
@@ -12,9 +12,13 @@
 #include <cstdio>
 #include <cstring>
 #include <fstream>
+#include <list>
 #include <map>
 #include <string>
 #include <thread>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
 #include <vector>
 #include <regex>
 #include <random>
@@ -108,6 +112,12 @@ static void byteswap_tensor(ggml_tensor * tensor) {
 //#define WHISPER_USE_FLASH_FF
 #define WHISPER_MAX_DECODERS 16
 
+// upper bound on the graph nodes added per sequence and decoder layer by a batched decode (see whisper_decode_batch_internal)
+#define WHISPER_DECODE_NODES_PER_SEQ 32
+
+// number of token positions in a block of the self-attention KV cache (see whisper_kv_pool)
+#define WHISPER_KV_BLOCK_SIZE 32
+
 #define WHISPER_USE_SCRATCH
 #define WHISPER_MAX_SCRATCH_BUFFERS 16
 
@@ -360,9 +370,18 @@ struct whisper_mel {
     int n_len_org;
     int n_mel;
 
+    uint64_t id = 0; // changes whenever the contents change (see whisper_mel_new_id)
+
     std::vector<float> data;
 };
 
+// a new id for the contents of a whisper_mel - copies of a spectrogram keep the id of the original
+static uint64_t whisper_mel_new_id() {
+    static std::atomic<uint64_t> id(0);
+
+    return ++id;
+}
+
 struct whisper_filters {
     int32_t n_mel;
     int32_t n_fft;
@@ -531,6 +550,33 @@ struct whisper_kv_cache {
     int n; // number of tokens currently in the cache
 };
 
+// self-attention KV cache shared by all decoders
+//
+// the cache is split in blocks of WHISPER_KV_BLOCK_SIZE token positions and each decoder maps its positions to blocks
+// through a page table (see whisper_kv_pages). the blocks are reference counted - decoders that share a history
+// (e.g. beams with the same parent) share its blocks, and a shared block is copied before it is written to
+//
+// whisper_full() sizes the pool for the number of decoders and the longest sequence its parameters allow, and
+// the pool grows when a decoder runs out of blocks
+//
+//   k: [n_text_layer][n_block*WHISPER_KV_BLOCK_SIZE][n_text_state]
+//   v: [n_text_layer][n_text_state][n_block*WHISPER_KV_BLOCK_SIZE]
+//
+struct whisper_kv_pool {
+    whisper_kv_cache cache;
+
+    int n_block = 0;
+
+    std::vector<int32_t> refs; // [n_block] number of page tables that use each block
+};
+
+// maps the token positions of a decoder to blocks of the whisper_kv_pool
+struct whisper_kv_pages {
+    std::vector<int32_t> blocks; // block i holds positions [i*WHISPER_KV_BLOCK_SIZE, (i + 1)*WHISPER_KV_BLOCK_SIZE)
+
+    int n = 0; // number of tokens currently in the cache
+};
+
 struct whisper_model {
     e_model type = MODEL_UNKNOWN;
 
@@ -591,8 +637,8 @@ struct whisper_sequence {
 
 // TAGS: WHISPER_DECODER_INIT
 struct whisper_decoder {
-    // each decoders keeps its own KV-cache
-    whisper_kv_cache kv_self;
+    // each decoder keeps its own page table into the shared self-attention KV cache
+    whisper_kv_pages kv_self;
 
     // the currently generated sequence of tokens
     whisper_sequence sequence;
@@ -607,8 +653,111 @@ struct whisper_decoder {
     std::vector<float> probs;
     std::vector<float> logits;
     std::vector<float> logprobs;
+};
+
+// identifies the PCM samples and the front-end parameters that produced a mel spectrogram
+struct whisper_mel_key {
+    bool valid = false;
+
+    uint64_t hash      = 0;
+    int      n_samples = 0;
+    int      fft_size  = 0;
+    int      fft_step  = 0;
+    bool     speed_up  = false;
+
+    bool operator==(const whisper_mel_key & other) const {
+        return valid && other.valid &&
+            hash      == other.hash      &&
+            n_samples == other.n_samples &&
+            fft_size  == other.fft_size  &&
+            fft_step  == other.fft_step  &&
+            speed_up  == other.speed_up;
+    }
+};
+
+// [EXPERIMENTAL] output of the convolutional stem of the encoder for a range of the spectrogram (see whisper_encode_stem)
+// consecutive windows of long audio overlap, so the columns of the previous window are kept and only the new ones computed
+struct whisper_stem_cache {
+    uint64_t mel_id = 0; // whisper_mel::id of the spectrogram the columns were computed from (0 - empty)
+
+    int phase = 0; // the stem has a stride of 2 - column c is centered on mel frame phase + 2*c
+    int c0    = 0; // first column held
+    int n     = 0; // number of columns held
+
+    std::vector<float> data; // [n][n_audio_state]
+};
+
+// identifies the window of audio whose encoder output is in the cross-attention KV cache
+struct whisper_kv_cross_src {
+    whisper_mel_key key;
+
+    int mel_offset = -1; // -1 - nothing has been encoded
+    int n_ctx      = 0;
+    int n_len      = 0;  // length of the spectrogram
+
+    bool stem_reuse = false; // the convolutional stem was taken from the stem cache (see whisper_encode_stem)
+};
+
+// [EXPERIMENTAL] file with the cross-attention KV cache of one encoded window (see whisper_encode_save())
+// K and V start at multiples of WHISPER_ENCODE_FILE_ALIGN and hold the in-memory layout of kv_cross,
+// so they can be read (or mapped) straight into place
+#define WHISPER_ENCODE_FILE_MAGIC   0x77656e63 // "wenc"
+#define WHISPER_ENCODE_FILE_VERSION 2
+#define WHISPER_ENCODE_FILE_ALIGN   4096
+
+struct whisper_encode_file_header {
+    uint32_t magic;
+    uint32_t version;
+
+    int32_t n_audio_state;
+    int32_t n_text_layer;
+    int32_t type;          // ggml_type of K and V
+    int32_t n_ctx;
+    int32_t mel_offset;
+    int32_t mel_n_len;
+
+    // the audio that was encoded (see whisper_mel_key)
+    uint64_t key_hash;
+    int32_t  key_valid;
+    int32_t  key_n_samples;
+    int32_t  key_fft_size;
+    int32_t  key_fft_step;
+    int32_t  key_speed_up;
+
+    int32_t  stem_reuse;
+
+    uint64_t nbytes;       // size of each of K and V
+};
+
+// [EXPERIMENTAL] bounded LRU cache of mel spectrograms and encoder outputs
+// used to avoid recomputing them when the same audio is processed repeatedly
+// the most recently used entries are at the front of the lists
+struct whisper_cache {
+    int n_mel_max    = 0; // 0 - disabled
+    int n_encode_max = 0; // 0 - disabled
 
-    std::vector<whisper_token> tokens_tmp; // used for whisper_decode calls
+    struct mel_entry {
+        whisper_mel_key key;
+        whisper_mel     mel;
+    };
+
+    // the used part of the cross-attention KV cache for a single encoder window
+    struct encode_entry {
+        whisper_mel_key key;
+
+        int  mel_offset;
+        int  n_ctx;
+        bool stem_reuse;
+
+        std::vector<uint8_t> k;
+        std::vector<uint8_t> v;
+    };
+
+    std::list<mel_entry>    mels;
+    std::list<encode_entry> encodes;
+
+    int32_t n_hit_mel    = 0;
+    int32_t n_hit_encode = 0;
 };
 
 struct whisper_state {
@@ -626,8 +775,16 @@ struct whisper_state {
     // cross-attention KV cache for the decoders
     // shared between all decoders
     whisper_kv_cache kv_cross;
+    whisper_kv_cross_src kv_cross_src;
     whisper_mel mel;
 
+    // [EXPERIMENTAL] mel / encoder cache
+    whisper_cache   cache;
+    whisper_mel_key mel_key; // identifies the audio currently in `mel` (if known)
+
+    // self-attention KV cache for the decoders
+    whisper_kv_pool kv_pool;
+
     whisper_decoder decoders[WHISPER_MAX_DECODERS] = {};
 
     // memory buffers used by encode / decode contexts
@@ -637,9 +794,15 @@ struct whisper_state {
     int    buf_last = 0;
     size_t buf_max_size[WHISPER_MAX_SCRATCH_BUFFERS] = { 0 };
 
+    // number of encoder windows the compute and scratch buffers are sized for (grown by batched encoding)
+    int    buf_n_batch = 1;
+
     // decode output (2-dimensional array: [n_tokens][n_vocab])
     std::vector<float> logits;
 
+    // output of the last whisper_encode_features() ([n_ctx][n_audio_state], in the caller's buffer or in the compute buffers)
+    const float * features = nullptr;
+
     std::vector<whisper_segment> result_all;
     std::vector<whisper_token>   prompt_past;
 
@@ -662,7 +825,21 @@ struct whisper_state {
     std::vector<float> energy; // PCM signal energy
 
     // [EXPERIMENTAL] speed-up techniques
-    int32_t exp_n_audio_ctx = 0; // 0 - use default
+    int32_t exp_n_audio_ctx = 0;     // 0 - use default
+    bool    exp_stem_reuse  = false; // take the convolutional stem of the encoder from `stem`
+
+    // [EXPERIMENTAL] restricted vocabulary - if not empty, the decoder computes the logits only for these tokens
+    // (sorted) and all other logits are -inf
+    std::vector<whisper_token> exp_vocab_allowed;
+
+    whisper_stem_cache stem;
+
+    // [EXPERIMENTAL] second set of encoder buffers for encoding the next window ahead (see whisper_encode_ahead)
+    whisper_state * state_ahead = nullptr;
+
+    // [EXPERIMENTAL] state of the draft model for speculative decoding (see whisper_speculative)
+    whisper_context * ctx_draft   = nullptr;
+    whisper_state   * state_draft = nullptr;
 
     void use_buf(struct ggml_context * ctx, int i) {
 #if defined(WHISPER_USE_SCRATCH)
@@ -702,6 +879,7 @@ struct whisper_context {
 
     ggml_type wtype = ggml_type::GGML_TYPE_F16; // weight type (FP32 / FP16 / QX)
     ggml_type itype = ggml_type::GGML_TYPE_F16; // intermediate type (FP32 or FP16)
+    ggml_type ktype = ggml_type::GGML_TYPE_F16; // cross-attention KV cache type (itype or Q8_0)
 
     whisper_model model;
     whisper_vocab vocab;
@@ -749,41 +927,231 @@ static bool kv_cache_init(
     return true;
 }
 
-static bool kv_cache_reinit(struct whisper_kv_cache & cache) {
-    WHISPER_ASSERT(cache.ctx);
+// number of positions per layer of the cross-attention KV cache for n_ctx encoder positions
+// V is stored transposed, so with a quantized type each of its rows is padded to an even number of blocks,
+// as the quantized dot products process pairs of blocks
+// (the padding of V is zero and the padding of K is masked out in the decoder)
+static int kv_cross_n_pad(ggml_type type, int n_ctx) {
+    const int n_blck = ggml_is_quantized(type) ? 2*ggml_blck_size(type) : 1;
 
-    const int n_elements = ggml_nelements(cache.k);
-    WHISPER_ASSERT(n_elements == ggml_nelements(cache.v));
+    return ((n_ctx + n_blck - 1)/n_blck)*n_blck;
+}
 
-    const ggml_type wtype = cache.k->type;
-    WHISPER_ASSERT(wtype == cache.v->type);
+static void kv_cache_free(struct whisper_kv_cache & cache) {
+    if (cache.ctx) {
+        ggml_free(cache.ctx);
+        cache.ctx = nullptr;
+    }
+}
 
-    WHISPER_ASSERT(cache.buf.size() >= 2*n_elements*ggml_type_sizef(wtype));
+// number of blocks of the whisper_kv_pool needed for a sequence of n_tokens tokens
+static int kv_pool_n_block(int n_tokens) {
+    return (n_tokens + WHISPER_KV_BLOCK_SIZE - 1)/WHISPER_KV_BLOCK_SIZE;
+}
 
-    struct ggml_init_params params = {
-        /*.mem_size   =*/ cache.buf.size(),
-        /*.mem_buffer =*/ cache.buf.data(),
-        /*.no_alloc   =*/ false,
-    };
+static bool kv_pool_init(
+        const struct whisper_hparams & hparams,
+              struct whisper_kv_pool & pool,
+                           ggml_type   wtype,
+                                 int   n_block) {
+    const size_t n_elements = (size_t) hparams.n_text_layer*hparams.n_text_state*n_block*WHISPER_KV_BLOCK_SIZE;
 
-    cache.ctx = ggml_init(params);
+    // k and v + their tensor objects
+    const size_t mem_bytes = 2*(n_elements*ggml_type_size(wtype) + GGML_OBJECT_SIZE + sizeof(struct ggml_tensor) + 64);
 
-    if (!cache.ctx) {
-        Rprintf("%s: failed to allocate memory for kv cache\n", __func__);
+    if (!kv_cache_init(hparams, mem_bytes, pool.cache, wtype, n_block*WHISPER_KV_BLOCK_SIZE)) {
         return false;
     }
 
-    cache.k = ggml_new_tensor_1d(cache.ctx, wtype, n_elements);
-    cache.v = ggml_new_tensor_1d(cache.ctx, wtype, n_elements);
+    pool.n_block = n_block;
+
+    pool.refs.assign(n_block, 0);
 
     return true;
 }
 
-static void kv_cache_free(struct whisper_kv_cache & cache) {
-    if (cache.ctx) {
-        ggml_free(cache.ctx);
-        cache.ctx = nullptr;
+// resize the pool to n_block blocks, keeping the contents of the blocks in use
+// (when shrinking, the blocks that are dropped must be free)
+static bool kv_pool_resize(
+        const struct whisper_hparams & hparams,
+              struct whisper_kv_pool & pool,
+                                 int   n_block) {
+    WHISPER_ASSERT(pool.cache.ctx);
+
+    if (pool.n_block == n_block) {
+        return true;
+    }
+
+    for (int i = n_block; i < pool.n_block; ++i) {
+        WHISPER_ASSERT(pool.refs[i] == 0);
+    }
+
+    whisper_kv_pool pool_new;
+
+    if (!kv_pool_init(hparams, pool_new, pool.cache.k->type, n_block)) {
+        return false;
+    }
+
+    const int n_keep = std::min(pool.n_block, n_block);
+
+    if (std::any_of(pool.refs.begin(), pool.refs.begin() + n_keep, [](int32_t r) { return r > 0; })) {
+        const int n_state = hparams.n_text_state;
+        const int n_layer = hparams.n_text_layer;
+
+        const size_t n_rows      = (size_t) pool.n_block*WHISPER_KV_BLOCK_SIZE;
+        const size_t n_rows_new  = (size_t) pool_new.n_block*WHISPER_KV_BLOCK_SIZE;
+        const size_t n_rows_keep = (size_t) n_keep*WHISPER_KV_BLOCK_SIZE;
+
+        const size_t es = ggml_element_size(pool.cache.k);
+
+        const char * k = (const char *) pool.cache.k->data;
+        const char * v = (const char *) pool.cache.v->data;
+
+        char * k_new = (char *) pool_new.cache.k->data;
+        char * v_new = (char *) pool_new.cache.v->data;
+
+        for (int il = 0; il < n_layer; ++il) {
+            memcpy(k_new + il*n_rows_new*n_state*es, k + il*n_rows*n_state*es, n_rows_keep*n_state*es);
+
+            for (int i = 0; i < n_state; ++i) {
+                memcpy(v_new + (il*n_state + i)*n_rows_new*es, v + (il*n_state + i)*n_rows*es, n_rows_keep*es);
+            }
+        }
+    }
+
+    std::copy(pool.refs.begin(), pool.refs.begin() + n_keep, pool_new.refs.begin());
+
+    kv_cache_free(pool.cache);
+
+    pool = std::move(pool_new);
+
+    return true;
+}
+
+// take a free block, preferring the one after `prev` so that the blocks of a sequence stay consecutive
+// if all blocks are in use, the pool grows by half
+static int kv_pool_alloc(
+        const struct whisper_hparams & hparams,
+              struct whisper_kv_pool & pool,
+                                 int   prev) {
+    if (prev >= 0 && prev + 1 < pool.n_block && pool.refs[prev + 1] == 0) {
+        pool.refs[prev + 1] = 1;
+        return prev + 1;
+    }
+
+    for (int i = 0; i < pool.n_block; ++i) {
+        if (pool.refs[i] == 0) {
+            pool.refs[i] = 1;
+            return i;
+        }
+    }
+
+    const int i = pool.n_block;
+
+    if (!kv_pool_resize(hparams, pool, pool.n_block + std::max(1, pool.n_block/2))) {
+        return -1;
+    }
+
+    pool.refs[i] = 1;
+
+    return i;
+}
+
+// copy the first n positions of block src to block dst in all layers
+static void kv_pool_copy(
+        const struct whisper_hparams & hparams,
+              struct whisper_kv_pool & pool,
+                                 int   src,
+                                 int   dst,
+                                 int   n) {
+    const int n_state = hparams.n_text_state;
+    const int n_layer = hparams.n_text_layer;
+
+    const size_t n_rows = (size_t) pool.n_block*WHISPER_KV_BLOCK_SIZE;
+
+    const size_t es = ggml_element_size(pool.cache.k);
+
+    char * k = (char *) pool.cache.k->data;
+    char * v = (char *) pool.cache.v->data;
+
+    for (int il = 0; il < n_layer; ++il) {
+        memcpy(k + (il*n_rows + dst*WHISPER_KV_BLOCK_SIZE)*n_state*es,
+               k + (il*n_rows + src*WHISPER_KV_BLOCK_SIZE)*n_state*es, n*n_state*es);
+
+        for (int i = 0; i < n_state; ++i) {
+            memcpy(v + ((il*n_state + i)*n_rows + dst*WHISPER_KV_BLOCK_SIZE)*es,
+                   v + ((il*n_state + i)*n_rows + src*WHISPER_KV_BLOCK_SIZE)*es, n*es);
+        }
+    }
+}
+
+// row of the pool (within a layer) that holds position p of the page table
+static inline int kv_pages_row(const struct whisper_kv_pages & pages, int p) {
+    return pages.blocks[p/WHISPER_KV_BLOCK_SIZE]*WHISPER_KV_BLOCK_SIZE + p%WHISPER_KV_BLOCK_SIZE;
+}
+
+static void kv_pages_retain(struct whisper_kv_pool & pool, const struct whisper_kv_pages & pages) {
+    for (const auto b : pages.blocks) {
+        ++pool.refs[b];
+    }
+}
+
+static void kv_pages_release(struct whisper_kv_pool & pool, struct whisper_kv_pages & pages) {
+    for (const auto b : pages.blocks) {
+        WHISPER_ASSERT(pool.refs[b] > 0);
+        --pool.refs[b];
+    }
+
+    pages.blocks.clear();
+    pages.n = 0;
+}
+
+// map the positions [0, n_past + n_tokens) and make the blocks of [n_past, n_past + n_tokens) private to the page table,
+// so that the new tokens can be stored - a block that is shared with other page tables is copied first (copy-on-write)
+static bool kv_pages_prepare(
+        const struct whisper_hparams & hparams,
+              struct whisper_kv_pool & pool,
+             struct whisper_kv_pages & pages,
+                                 int   n_past,
+                                 int   n_tokens) {
+    if (n_past + n_tokens > hparams.n_text_ctx) {
+        return false;
+    }
+
+    const int n_block_end = (n_past + n_tokens + WHISPER_KV_BLOCK_SIZE - 1)/WHISPER_KV_BLOCK_SIZE;
+
+    while ((int) pages.blocks.size() < n_block_end) {
+        const int b = kv_pool_alloc(hparams, pool, pages.blocks.empty() ? -1 : pages.blocks.back());
+        if (b < 0) {
+            return false;
+        }
+
+        pages.blocks.push_back(b);
+    }
+
+    for (int i = n_past/WHISPER_KV_BLOCK_SIZE; i < n_block_end; ++i) {
+        const int b_old = pages.blocks[i];
+
+        if (pool.refs[b_old] == 1) {
+            continue;
+        }
+
+        const int b_new = kv_pool_alloc(hparams, pool, i > 0 ? pages.blocks[i - 1] : -1);
+        if (b_new < 0) {
+            return false;
+        }
+
+        // only the positions before n_past hold data
+        const int n_copy = std::min(n_past - i*WHISPER_KV_BLOCK_SIZE, WHISPER_KV_BLOCK_SIZE);
+        if (n_copy > 0) {
+            kv_pool_copy(hparams, pool, b_old, b_new, n_copy);
+        }
+
+        --pool.refs[b_old];
+        pages.blocks[i] = b_new;
     }
+
+    return true;
 }
 
 // load the model from a ggml file
@@ -1402,156 +1770,488 @@ static bool whisper_model_load(struct whisper_model_loader * loader, whisper_con
     return true;
 }
 
-// evaluate the encoder with the given state
-//
-// given audio recording (more specifically, its log mel spectrogram), runs forward pass of the encoder
-// part of the transformer model and returns the encoded features
-//
-//   - wctx:      the model
-//   - wstate:     the state of the encoder
-//   - n_threads:  number of threads to use
-//   - mel_offset: offset in the mel spectrogram (i.e. audio offset)
-//
-static bool whisper_encode_internal(
-        whisper_context & wctx,
-          whisper_state & wstate,
-              const int   mel_offset,
-              const int   n_threads){
+// the part of the cross-attention KV cache written by a single encoder window
+static size_t whisper_cache_encode_nbytes(const whisper_kv_cache & kv, int n_layer, int n_ctx, int n_state) {
+    const ggml_type type = kv.k->type;
 
-    const int64_t t_start_us = ggml_time_us();
+    return ggml_type_size(type)*n_layer*kv_cross_n_pad(type, n_ctx)*n_state/ggml_blck_size(type);
+}
 
-    const auto & model   = wctx.model;
-    const auto & mel_inp = wstate.mel;
-    const auto & hparams = model.hparams;
+// find the cached encoder output for a window of the current audio and mark it as recently used
+// returns nullptr if the window is not cached
+static whisper_cache::encode_entry * whisper_cache_find_encode(whisper_state & wstate, int mel_offset, int n_ctx) {
+    auto & cache = wstate.cache;
 
-    const int n_ctx   = wstate.exp_n_audio_ctx > 0 ? wstate.exp_n_audio_ctx : hparams.n_audio_ctx;
-    const int n_state = hparams.n_audio_state;
-    const int n_head  = hparams.n_audio_head;
-    const int n_layer = hparams.n_audio_layer;
+    if (cache.n_encode_max <= 0 || !wstate.mel_key.valid) {
+        return nullptr;
+    }
 
-    const int n_mels = hparams.n_mels;
-    assert(mel_inp.n_mel == n_mels);
+    for (auto it = cache.encodes.begin(); it != cache.encodes.end(); ++it) {
+        if (it->key == wstate.mel_key && it->mel_offset == mel_offset && it->n_ctx == n_ctx && it->stem_reuse == wstate.exp_stem_reuse) {
+            cache.encodes.splice(cache.encodes.begin(), cache.encodes, it);
 
-    struct ggml_init_params params = {
-        /*.mem_size   =*/ wstate.buf_compute.size(),
-        /*.mem_buffer =*/ wstate.buf_compute.data(),
-        /*.no_alloc   =*/ false,
-    };
+            return &cache.encodes.front();
+        }
+    }
 
-    struct ggml_context * ctx0 = ggml_init(params);
+    return nullptr;
+}
 
-    wstate.use_buf(ctx0, 0);
+// add an entry for a window of the current audio, evicting the least recently used entry if full
+// the caller fills in the data
+static whisper_cache::encode_entry & whisper_cache_new_encode(whisper_state & wstate, int mel_offset, int n_ctx, size_t nbytes) {
+    auto & cache = wstate.cache;
 
-    struct ggml_tensor * mel = ggml_new_tensor_2d(ctx0, GGML_TYPE_F32, 2*n_ctx, n_mels);
-    assert(mel->type == GGML_TYPE_F32);
-    {
-        float * dst = (float *) mel->data;
-        memset(dst, 0, ggml_nbytes(mel));
+    // reuse the buffers of the evicted entry
+    if ((int) cache.encodes.size() >= cache.n_encode_max) {
+        cache.encodes.splice(cache.encodes.begin(), cache.encodes, std::prev(cache.encodes.end()));
+    } else {
+        cache.encodes.emplace_front();
+    }
 
-        const int i0 = std::min(mel_offset, mel_inp.n_len);
-        const int i1 = std::min(mel_offset + 2*n_ctx, mel_inp.n_len);
+    auto & entry = cache.encodes.front();
 
-        for (int j = 0; j < mel_inp.n_mel; ++j) {
-            for (int i = i0; i < i1; ++i) {
-                dst[j*2*n_ctx + (i - i0)] = mel_inp.data[j*mel_inp.n_len + i];
-            }
-        }
-    }
+    entry.key        = wstate.mel_key;
+    entry.mel_offset = mel_offset;
+    entry.n_ctx      = n_ctx;
+    entry.stem_reuse = wstate.exp_stem_reuse;
 
-    struct ggml_tensor * cur;
+    entry.k.resize(nbytes);
+    entry.v.resize(nbytes);
 
-#ifndef WHISPER_USE_COREML
-    const bool use_coreml = false;
-#else
-    const bool use_coreml = wstate.ctx_coreml != nullptr;
-#endif
+    return entry;
+}
 
-    if (!use_coreml) {
-        // convolution + gelu
-        {
-            wstate.use_buf(ctx0, 1);
+// restore the cross-attention KV cache from the encoder cache
+// returns false if the window is not cached
+static bool whisper_cache_get_encode(whisper_state & wstate, int mel_offset, int n_ctx, int n_layer, int n_state) {
+    const auto * entry = whisper_cache_find_encode(wstate, mel_offset, n_ctx);
 
-            cur = ggml_conv_1d_1s(ctx0, model.e_conv_1_w, mel);
-            cur = ggml_add(ctx0,
-                    ggml_repeat(ctx0,
-                        model.e_conv_1_b,
-                        cur),
-                    cur);
+    if (entry == nullptr) {
+        return false;
+    }
 
-            cur = ggml_gelu(ctx0, cur);
+    const size_t nbytes = whisper_cache_encode_nbytes(wstate.kv_cross, n_layer, n_ctx, n_state);
 
-            wstate.use_buf(ctx0, 0);
+    memcpy(wstate.kv_cross.k->data, entry->k.data(), nbytes);
+    memcpy(wstate.kv_cross.v->data, entry->v.data(), nbytes);
 
-            cur = ggml_conv_1d_2s(ctx0, model.e_conv_2_w, cur);
-            cur = ggml_add(ctx0,
-                    ggml_repeat(ctx0,
-                        model.e_conv_2_b,
-                        cur),
-                    cur);
+    wstate.cache.n_hit_encode++;
 
-            cur = ggml_gelu(ctx0, cur);
-        }
+    return true;
+}
 
-        wstate.use_buf(ctx0, 3);
+// store the cross-attention KV cache of the last encoder window
+static void whisper_cache_put_encode(whisper_state & wstate, int mel_offset, int n_ctx, int n_layer, int n_state) {
+    if (wstate.cache.n_encode_max <= 0 || !wstate.mel_key.valid) {
+        return;
+    }
 
-        // ===================================================================
-        // NOTE: experimenting with partial evaluation of the encoder (ignore)
-        //static int iter = -1;
-        //const int n_iter = 1500/n_ctx;
+    const size_t nbytes = whisper_cache_encode_nbytes(wstate.kv_cross, n_layer, n_ctx, n_state);
 
-        //iter = (iter + 1) % n_iter;
+    auto & entry = whisper_cache_new_encode(wstate, mel_offset, n_ctx, nbytes);
 
-        //if (iter == 0) {
-        //    memset(model.memory_cross_k->data, 0, ggml_nbytes(model.memory_cross_k));
-        //    memset(model.memory_cross_v->data, 0, ggml_nbytes(model.memory_cross_v));
-        //}
+    memcpy(entry.k.data(), wstate.kv_cross.k->data, nbytes);
+    memcpy(entry.v.data(), wstate.kv_cross.v->data, nbytes);
+}
 
-        static int iter = 0;
+// create the input tensor of the encoder for the window of the spectrogram starting at mel_offset
+// if the window is fully inside the spectrogram, the tensor is a strided view of it instead of a copy
+// (the convolution reads the rows of its input through nb[1])
+static struct ggml_tensor * whisper_encode_mel_window(
+        struct ggml_context * ctx0,
+        const whisper_mel   & mel_inp,
+                  const int   mel_offset,
+                  const int   n_ctx,
+                 const bool   allow_view) {
+    const int n_mels = mel_inp.n_mel;
+
+    struct ggml_tensor * mel;
+    if (allow_view && mel_offset >= 0 && mel_offset + 2*n_ctx <= mel_inp.n_len) {
+        ggml_set_no_alloc(ctx0, true);
+        mel = ggml_new_tensor_2d(ctx0, GGML_TYPE_F32, 2*n_ctx, n_mels);
+        ggml_set_no_alloc(ctx0, false);
+
+        mel->data  = (void *) (mel_inp.data.data() + mel_offset);
+        mel->nb[1] = mel_inp.n_len*sizeof(float);
+        mel->nb[2] = mel->nb[1]*n_mels;
+        mel->nb[3] = mel->nb[2];
+    } else {
+        mel = ggml_new_tensor_2d(ctx0, GGML_TYPE_F32, 2*n_ctx, n_mels);
 
-        const size_t e_pe_stride = model.e_pe->ne[0]*ggml_element_size(model.e_pe);
-        const size_t e_pe_offset = model.e_pe->ne[0]*ggml_element_size(model.e_pe)*n_ctx*iter;
+        float * dst = (float *) mel->data;
+        memset(dst, 0, ggml_nbytes(mel));
 
-        struct ggml_tensor * e_pe = ggml_view_2d(ctx0, model.e_pe, model.e_pe->ne[0], n_ctx, e_pe_stride, e_pe_offset);
+        // frames before the start or past the end of the spectrogram are zero
+        const int i0 = std::min(std::max(mel_offset, 0), mel_inp.n_len);
+        const int i1 = std::min(mel_offset + 2*n_ctx, mel_inp.n_len);
 
-        cur = ggml_add(ctx0, e_pe, ggml_transpose(ctx0, cur));
+        if (i1 > i0) {
+            for (int j = 0; j < n_mels; ++j) {
+                memcpy(dst + j*2*n_ctx + (i0 - mel_offset), mel_inp.data.data() + j*mel_inp.n_len + i0, (i1 - i0)*sizeof(float));
+            }
+        }
+    }
+    assert(mel->type == GGML_TYPE_F32);
 
-        // ===================================================================
+    return mel;
+}
 
-        // original:
-        //cur = ggml_add(ctx0, model.e_pe, ggml_transpose(ctx0, cur));
+// [EXPERIMENTAL] compute columns [c_beg, c_end) of the convolutional stem into dst ([c_end - c_beg][n_state])
+//
+// the spectrogram is sliced with 2 frames of context on each side, so that every column sees the actual
+// neighbouring frames - the first and the last output of the slice see zero padding and are dropped
+static void whisper_encode_stem_range(
+        whisper_context & wctx,
+          whisper_state & wstate,
+              const int   phase,
+              const int   c_beg,
+              const int   c_end,
+                  float * dst,
+              const int   n_threads) {
+    const auto & model = wctx.model;
 
-        struct ggml_tensor * inpL = cur;
+    const int n_state = model.hparams.n_audio_state;
+    const int n_out   = c_end - c_beg + 2;
 
-        for (int il = 0; il < n_layer; ++il) {
-            const auto & layer = model.layers_encoder[il];
+    struct ggml_init_params params = {
+        /*.mem_size   =*/ wstate.buf_compute.size(),
+        /*.mem_buffer =*/ wstate.buf_compute.data(),
+        /*.no_alloc   =*/ false,
+    };
 
-            // norm
-            {
-                wstate.use_buf(ctx0, 0);
+    struct ggml_context * ctx0 = ggml_init(params);
 
-                cur = ggml_norm(ctx0, inpL);
+    struct ggml_cgraph gf = {};
+    gf.n_threads = n_threads;
 
-                // cur = ln_0_w*cur + ln_0_b
-                cur = ggml_add(ctx0,
-                        ggml_mul(ctx0,
-                            ggml_repeat(ctx0, layer.attn_ln_0_w, cur),
-                            cur),
-                        ggml_repeat(ctx0, layer.attn_ln_0_b, cur));
-            }
+    wstate.use_buf(ctx0, -1);
 
-            // self-attention
-            {
-                wstate.use_buf(ctx0, 1);
+    struct ggml_tensor * mel = whisper_encode_mel_window(ctx0, wstate.mel, phase + 2*c_beg - 2, n_out, true);
 
-                struct ggml_tensor * Qcur = ggml_mul_mat(ctx0,
-                        layer.attn_q_w,
-                        cur);
+    wstate.use_buf(ctx0, 1);
+
+    struct ggml_tensor * cur = ggml_conv_1d_1s_gelu(ctx0, model.e_conv_1_w, mel, model.e_conv_1_b);
+
+    wstate.use_buf(ctx0, 0);
+
+    cur = ggml_conv_1d_2s_gelu(ctx0, model.e_conv_2_w, cur, model.e_conv_2_b);
+
+    wstate.use_buf(ctx0, -1);
+
+    ggml_build_forward_expand(&gf, cur);
+    ggml_graph_compute(ctx0, &gf);
+
+    // [n_out, n_state] -> [n_out - 2][n_state]
+    for (int i = 0; i < n_state; ++i) {
+        const float * src = (const float *) ((const char *) cur->data + i*cur->nb[1]);
+
+        for (int c = 1; c < n_out - 1; ++c) {
+            dst[(c - 1)*n_state + i] = src[c];
+        }
+    }
+
+    ggml_free(ctx0);
+}
+
+// [EXPERIMENTAL] the output of the convolutional stem for the window at mel_offset ([n_ctx][n_state])
+//
+// the columns are the same as if the stem was computed for the whole spectrogram at once (a window encoded
+// on its own sees zero padding at its edges instead, so its first and last column differ).
+// the columns that the previous window has in common with this one are reused
+static const float * whisper_encode_stem(
+        whisper_context & wctx,
+          whisper_state & wstate,
+              const int   mel_offset,
+              const int   n_ctx,
+              const int   n_threads) {
+    const int n_state = wctx.model.hparams.n_audio_state;
+
+    auto & stem = wstate.stem;
+
+    const int phase = mel_offset & 1;
+    const int c0    = mel_offset/2;
+    const int c1    = c0 + n_ctx;
+
+    // the columns that are already computed
+    int k0 = c1;
+    int k1 = c1;
+
+    if (stem.mel_id == wstate.mel.id && stem.phase == phase) {
+        k0 = std::max(c0, stem.c0);
+        k1 = std::min(c1, stem.c0 + stem.n);
+
+        if (k0 >= k1) {
+            k0 = k1 = c1;
+        }
+    }
+
+    stem.data.resize(std::max(stem.data.size(), (size_t) n_ctx*n_state));
+
+    if (k0 < k1) {
+        memmove(stem.data.data() + (k0 - c0)*n_state, stem.data.data() + (k0 - stem.c0)*n_state, (k1 - k0)*n_state*sizeof(float));
+    }
+
+    if (c0 < k0) {
+        whisper_encode_stem_range(wctx, wstate, phase, c0, k0, stem.data.data(), n_threads);
+    }
+
+    if (k1 < c1) {
+        whisper_encode_stem_range(wctx, wstate, phase, k1, c1, stem.data.data() + (k1 - c0)*n_state, n_threads);
+    }
+
+    stem.mel_id = wstate.mel.id;
+    stem.phase  = phase;
+    stem.c0     = c0;
+    stem.n      = n_ctx;
+
+    return stem.data.data();
+}
+
+// evaluate the encoder with the given state
+//
+// given audio recording (more specifically, its log mel spectrogram), runs forward pass of the encoder
+// part of the transformer model and returns the encoded features
+//
+// several windows of the spectrogram can be encoded in a single batched graph, so that the weights are
+// read once for all windows. the output of the first window goes to the cross-attention KV cache of the
+// state, the output of the other windows goes to the encoder cache (see whisper_cache)
+//
+//   - wctx:        the model
+//   - wstate:      the state of the encoder
+//   - n_threads:   number of threads to use
+//   - mel_offsets: offsets in the mel spectrogram (i.e. audio offsets), one per window
+//   - n_batch:     number of windows
+//   - features:    only run the encoder up to features_layer and keep its output in wstate.features
+//                  instead of computing the cross-attention KV cache (n_batch must be 1)
+//   - features_out: if not null, the features are written here, otherwise they are left in the compute buffers
+//   - features_layer: encoder block to take the output of, -1 for the final (normalized) output
+//
+static bool whisper_encode_batch_internal(
+        whisper_context & wctx,
+          whisper_state & wstate,
+              const int * mel_offsets,
+              const int   n_batch,
+              const int   n_threads,
+             const bool   features,
+                  float * features_out,
+              const int   features_layer){
+
+    const int64_t t_start_us = ggml_time_us();
+
+    const auto & model   = wctx.model;
+    const auto & mel_inp = wstate.mel;
+    const auto & hparams = model.hparams;
+
+    const int n_ctx   = wstate.exp_n_audio_ctx > 0 ? wstate.exp_n_audio_ctx : hparams.n_audio_ctx;
+    const int n_state = hparams.n_audio_state;
+    const int n_head  = hparams.n_audio_head;
+    const int n_layer = hparams.n_audio_layer;
+
+    const int n_text_layer = hparams.n_text_layer;
+
+    const int n_mels = hparams.n_mels;
+    assert(mel_inp.n_mel == n_mels);
+
+#ifndef WHISPER_USE_COREML
+    const bool use_coreml = false;
+#else
+    const bool use_coreml = wstate.ctx_coreml != nullptr;
+#endif
+
+    if (features) {
+        GGML_ASSERT(n_batch == 1);
+
+        if (features_layer >= n_layer || (use_coreml && features_layer >= 0)) {
+            Rprintf("%s: invalid encoder layer %d\n", __func__, features_layer);
+            return false;
+        }
+    }
+
+    if (n_batch > 1) {
+        if (wstate.cache.n_encode_max < n_batch || !wstate.mel_key.valid) {
+            Rprintf("%s: batched encoding requires the encoder cache to hold %d windows of audio from whisper_pcm_to_mel()\n", __func__, n_batch);
+            return false;
+        }
+
+        // the Core ML encoder processes a single window - encode the windows one by one,
+        // finishing with the first one so that it ends up in the cross-attention KV cache
+        if (use_coreml) {
+            for (int b = n_batch - 1; b >= 0; --b) {
+                if (!whisper_encode_batch_internal(wctx, wstate, mel_offsets + b, 1, n_threads, false, nullptr, -1)) {
+                    return false;
+                }
+            }
+
+            return true;
+        }
+    }
+
+    const size_t kv_nbytes = whisper_cache_encode_nbytes(wstate.kv_cross, n_text_layer, n_ctx, n_state);
+
+    // the windows that have to be computed and where their output goes
+    // (nullptr - the cross-attention KV cache of the state)
+    std::vector<int> offsets;
+    std::vector<whisper_cache::encode_entry *> slots;
+
+    // the same window of the same audio has already been encoded
+    // (the encoder cache holds the cross-attention KV cache only, so features are always computed)
+    if (features || !whisper_cache_get_encode(wstate, mel_offsets[0], n_ctx, n_text_layer, n_state)) {
+        offsets.push_back(mel_offsets[0]);
+        slots.push_back(nullptr);
+    }
+
+    for (int b = 1; b < n_batch; ++b) {
+        if (mel_offsets[b] == mel_offsets[0] || whisper_cache_find_encode(wstate, mel_offsets[b], n_ctx) != nullptr) {
+            continue;
+        }
+
+        offsets.push_back(mel_offsets[b]);
+        slots.push_back(&whisper_cache_new_encode(wstate, mel_offsets[b], n_ctx, kv_nbytes));
+    }
+
+    const int n_batch_cur = offsets.size();
+
+    if (!features) {
+        auto & src = wstate.kv_cross_src;
+
+        src.key        = wstate.mel_key;
+        src.mel_offset = mel_offsets[0];
+        src.n_ctx      = n_ctx;
+        src.n_len      = mel_inp.n_len_org;
+        src.stem_reuse = wstate.exp_stem_reuse;
+    }
+
+    if (n_batch_cur == 0) {
+        wstate.t_encode_us += ggml_time_us() - t_start_us;
+
+        return true;
+    }
+
+    // the output of the convolutional stem, computed incrementally across overlapping windows
+    const float * stem = nullptr;
+
+    if (wstate.exp_stem_reuse && n_batch_cur == 1 && !use_coreml) {
+        stem = whisper_encode_stem(wctx, wstate, offsets[0], n_ctx, n_threads);
+    }
+
+    // the compute and scratch buffers are sized for buf_n_batch windows - grow them once for the largest batch
+    // seen by the state, so that repeated batched calls do not reallocate them
+    if (n_batch_cur > wstate.buf_n_batch) {
+        wstate.buf_compute.resize(wstate.buf_compute.size()/wstate.buf_n_batch*n_batch_cur);
+        for (int i = 0; i < WHISPER_MAX_SCRATCH_BUFFERS; ++i) {
+            wstate.buf_scratch[i].resize(wstate.buf_scratch[i].size()/wstate.buf_n_batch*n_batch_cur);
+        }
+        wstate.buf_n_batch = n_batch_cur;
+    }
+
+    struct ggml_init_params params = {
+        /*.mem_size   =*/ wstate.buf_compute.size(),
+        /*.mem_buffer =*/ wstate.buf_compute.data(),
+        /*.no_alloc   =*/ false,
+    };
+
+    struct ggml_context * ctx0 = ggml_init(params);
+
+    struct ggml_tensor * cur = nullptr;
+
+    if (!use_coreml) {
+        struct ggml_cgraph gf = {};
+        gf.n_threads = n_threads;
+
+        // the windows are stacked into a single [n_state, n_batch*n_ctx] input
+        wstate.use_buf(ctx0, 3);
+
+        struct ggml_tensor * inp = n_batch_cur > 1 ? ggml_new_tensor_2d(ctx0, GGML_TYPE_F32, n_state, n_batch_cur*n_ctx) : nullptr;
+
+        for (int b = 0; b < n_batch_cur; ++b) {
+            if (stem != nullptr) {
+                ggml_set_no_alloc(ctx0, true);
+                cur = ggml_new_tensor_2d(ctx0, GGML_TYPE_F32, n_state, n_ctx);
+                ggml_set_no_alloc(ctx0, false);
+
+                cur->data = (void *) stem;
+            } else {
+                // a padded window is copied - keep it in the context memory, the scratch buffers are reused
+                // by the convolutions of this and of the other windows before it is read
+                wstate.use_buf(ctx0, -1);
+
+                struct ggml_tensor * mel = whisper_encode_mel_window(ctx0, mel_inp, offsets[b], n_ctx, true);
 
-                Qcur = ggml_add(ctx0,
-                        ggml_repeat(ctx0,
-                            layer.attn_q_b,
-                            Qcur),
-                        Qcur);
+                // convolution + gelu
+                wstate.use_buf(ctx0, 1);
+
+                // bias + gelu are fused into the convolutions
+                cur = ggml_conv_1d_1s_gelu(ctx0, model.e_conv_1_w, mel, model.e_conv_1_b);
+
+                wstate.use_buf(ctx0, 0);
+
+                cur = ggml_conv_1d_2s_gelu(ctx0, model.e_conv_2_w, cur, model.e_conv_2_b);
+
+                cur = ggml_transpose(ctx0, cur);
+            }
+
+            wstate.use_buf(ctx0, n_batch_cur > 1 ? 2 : 3);
+
+            // ===================================================================
+            // NOTE: experimenting with partial evaluation of the encoder (ignore)
+            //static int iter = -1;
+            //const int n_iter = 1500/n_ctx;
+
+            //iter = (iter + 1) % n_iter;
+
+            //if (iter == 0) {
+            //    memset(model.memory_cross_k->data, 0, ggml_nbytes(model.memory_cross_k));
+            //    memset(model.memory_cross_v->data, 0, ggml_nbytes(model.memory_cross_v));
+            //}
+
+            static int iter = 0;
+
+            const size_t e_pe_stride = model.e_pe->ne[0]*ggml_element_size(model.e_pe);
+            const size_t e_pe_offset = model.e_pe->ne[0]*ggml_element_size(model.e_pe)*n_ctx*iter;
+
+            struct ggml_tensor * e_pe = ggml_view_2d(ctx0, model.e_pe, model.e_pe->ne[0], n_ctx, e_pe_stride, e_pe_offset);
+
+            cur = ggml_add(ctx0, e_pe, cur);
+
+            // ===================================================================
+
+            // original:
+            //cur = ggml_add(ctx0, model.e_pe, ggml_transpose(ctx0, cur));
+
+            // the stems of the windows are computed one after the other, each one copied into the batch
+            if (n_batch_cur > 1) {
+                ggml_build_forward_expand(&gf, ggml_cpy(ctx0, cur,
+                            ggml_view_2d(ctx0, inp, n_state, n_ctx, inp->nb[1], b*n_ctx*inp->nb[1])));
+            }
+        }
+
+        struct ggml_tensor * inpL = n_batch_cur > 1 ? inp : cur;
+
+        // the blocks after the requested features are not needed
+        const bool features_inner = features && features_layer >= 0;
+
+        const int n_layer_cur = features_inner ? features_layer + 1 : n_layer;
+
+        for (int il = 0; il < n_layer_cur; ++il) {
+            const auto & layer = model.layers_encoder[il];
+
+            // norm
+            {
+                wstate.use_buf(ctx0, 0);
+
+                // cur = ln_0_w*norm(inpL) + ln_0_b
+                cur = ggml_norm_affine(ctx0, inpL, layer.attn_ln_0_w, layer.attn_ln_0_b);
+            }
+
+            // self-attention
+            {
+                wstate.use_buf(ctx0, 1);
+
+                struct ggml_tensor * Qcur = ggml_mul_mat_bias(ctx0,
+                        layer.attn_q_w,
+                        cur,
+                        layer.attn_q_b);
 
                 //Qcur = ggml_scale_inplace(ctx0, Qcur, ggml_new_f32(ctx0, pow(float(n_state)/n_head, -0.25)));
 
@@ -1562,15 +2262,10 @@ static bool whisper_encode_internal(
 
                 //Kcur = ggml_scale_inplace(ctx0, Kcur, ggml_new_f32(ctx0, pow(float(n_state)/n_head, -0.25)));
 
-                struct ggml_tensor * Vcur = ggml_mul_mat(ctx0,
+                struct ggml_tensor * Vcur = ggml_mul_mat_bias(ctx0,
                         layer.attn_v_w,
-                        cur);
-
-                Vcur = ggml_add(ctx0,
-                        ggml_repeat(ctx0,
-                            layer.attn_v_b,
-                            Vcur),
-                        Vcur);
+                        cur,
+                        layer.attn_v_b);
 
                 // ------
 
@@ -1581,24 +2276,24 @@ static bool whisper_encode_internal(
                     ggml_permute(ctx0,
                             ggml_cpy(ctx0,
                                 Qcur,
-                                ggml_new_tensor_3d(ctx0, wctx.itype, n_state/n_head, n_head, n_ctx)),
+                                ggml_new_tensor_4d(ctx0, wctx.itype, n_state/n_head, n_head, n_ctx, n_batch_cur)),
                             0, 2, 1, 3);
 
                 struct ggml_tensor * K =
                     ggml_permute(ctx0,
                             ggml_cpy(ctx0,
                                 Kcur,
-                                ggml_new_tensor_3d(ctx0, wctx.itype, n_state/n_head, n_head, n_ctx)),
+                                ggml_new_tensor_4d(ctx0, wctx.itype, n_state/n_head, n_head, n_ctx, n_batch_cur)),
                             0, 2, 1, 3);
 
                 struct ggml_tensor * V =
                     ggml_cpy(ctx0,
                             ggml_permute(ctx0,
-                                ggml_reshape_3d(ctx0,
+                                ggml_reshape_4d(ctx0,
                                     Vcur,
-                                    n_state/n_head, n_head, n_ctx),
+                                    n_state/n_head, n_head, n_ctx, n_batch_cur),
                                 1, 2, 0, 3),
-                            ggml_new_tensor_3d(ctx0, wctx.itype, n_ctx, n_state/n_head, n_head));
+                            ggml_new_tensor_4d(ctx0, wctx.itype, n_ctx, n_state/n_head, n_head, n_batch_cur));
 
                 struct ggml_tensor * KQV = ggml_flash_attn(ctx0, Q, K, V, false);
 #else
@@ -1606,14 +2301,14 @@ static bool whisper_encode_internal(
                     ggml_permute(ctx0,
                             ggml_cpy(ctx0,
                                 Qcur,
-                                ggml_new_tensor_3d(ctx0, GGML_TYPE_F32, n_state/n_head, n_head, n_ctx)),
+                                ggml_new_tensor_4d(ctx0, GGML_TYPE_F32, n_state/n_head, n_head, n_ctx, n_batch_cur)),
                             0, 2, 1, 3);
 
                 struct ggml_tensor * K =
                     ggml_permute(ctx0,
                             ggml_cpy(ctx0,
                                 Kcur,
-                                ggml_new_tensor_3d(ctx0, wctx.itype, n_state/n_head, n_head, n_ctx)),
+                                ggml_new_tensor_4d(ctx0, wctx.itype, n_state/n_head, n_head, n_ctx, n_batch_cur)),
                             0, 2, 1, 3);
 
                 // K * Q
@@ -1630,11 +2325,11 @@ static bool whisper_encode_internal(
                 struct ggml_tensor * V =
                     ggml_cpy(ctx0,
                             ggml_permute(ctx0,
-                                ggml_reshape_3d(ctx0,
+                                ggml_reshape_4d(ctx0,
                                     Vcur,
-                                    n_state/n_head, n_head, n_ctx),
+                                    n_state/n_head, n_head, n_ctx, n_batch_cur),
                                 1, 2, 0, 3),
-                            ggml_new_tensor_3d(ctx0, wctx.itype, n_ctx, n_state/n_head, n_head)
+                            ggml_new_tensor_4d(ctx0, wctx.itype, n_ctx, n_state/n_head, n_head, n_batch_cur)
                             );
 
                 struct ggml_tensor * KQV = ggml_mul_mat(ctx0, V, KQ_soft_max);
@@ -1645,22 +2340,17 @@ static bool whisper_encode_internal(
 
                 cur = ggml_cpy(ctx0,
                         KQV_merged,
-                        ggml_new_tensor_2d(ctx0, GGML_TYPE_F32, n_state, n_ctx));
+                        ggml_new_tensor_2d(ctx0, GGML_TYPE_F32, n_state, n_batch_cur*n_ctx));
             }
 
             // projection
             {
                 wstate.use_buf(ctx0, 0);
 
-                cur = ggml_mul_mat(ctx0,
+                cur = ggml_mul_mat_bias(ctx0,
                         layer.attn_ln_1_w,
-                        cur);
-
-                wstate.use_buf(ctx0, 1);
-
-                cur = ggml_add(ctx0,
-                        ggml_repeat(ctx0, layer.attn_ln_1_b, cur),
-                        cur);
+                        cur,
+                        layer.attn_ln_1_b);
             }
 
             wstate.use_buf(ctx0, 2);
@@ -1674,57 +2364,34 @@ static bool whisper_encode_internal(
             {
                 // norm
                 {
-                    wstate.use_buf(ctx0, 0);
-
-                    cur = ggml_norm(ctx0, inpFF);
-
                     wstate.use_buf(ctx0, 1);
 
-                    // cur = mlp_ln_w*cur + mlp_ln_b
-                    cur = ggml_add(ctx0,
-                            ggml_mul(ctx0,
-                                ggml_repeat(ctx0, layer.mlp_ln_w, cur),
-                                cur),
-                            ggml_repeat(ctx0, layer.mlp_ln_b, cur));
+                    // cur = mlp_ln_w*norm(inpFF) + mlp_ln_b
+                    cur = ggml_norm_affine(ctx0, inpFF, layer.mlp_ln_w, layer.mlp_ln_b);
                 }
 
 #ifdef WHISPER_USE_FLASH_FF
                 wstate.use_buf(ctx0, 0);
 
                 cur = ggml_flash_ff(ctx0,
-                        ggml_cpy(ctx0, cur, ggml_new_tensor_2d(ctx0, wstate.itype, n_state, n_ctx)),
+                        ggml_cpy(ctx0, cur, ggml_new_tensor_2d(ctx0, wstate.itype, n_state, n_batch_cur*n_ctx)),
                         layer.mlp_0_w, layer.mlp_0_b, layer.mlp_1_w, layer.mlp_1_b);
 #else
                 wstate.use_buf(ctx0, 0);
 
-                // fully connected
-                cur = ggml_mul_mat(ctx0,
+                // fully connected + GELU activation
+                cur = ggml_mul_mat_bias_gelu(ctx0,
                         layer.mlp_0_w,
-                        cur);
-
-                wstate.use_buf(ctx0, 1);
-
-                cur = ggml_add(ctx0,
-                        ggml_repeat(ctx0, layer.mlp_0_b, cur),
-                        cur);
-
-                wstate.use_buf(ctx0, 0);
-
-                // GELU activation
-                cur = ggml_gelu(ctx0, cur);
+                        cur,
+                        layer.mlp_0_b);
 
                 wstate.use_buf(ctx0, 1);
 
                 // projection
-                cur = ggml_mul_mat(ctx0,
+                cur = ggml_mul_mat_bias(ctx0,
                         layer.mlp_1_w,
-                        cur);
-
-                wstate.use_buf(ctx0, 0);
-
-                cur = ggml_add(ctx0,
-                        ggml_repeat(ctx0, layer.mlp_1_b, cur),
-                        cur);
+                        cur,
+                        layer.mlp_1_b);
 #endif
             }
 
@@ -1736,28 +2403,29 @@ static bool whisper_encode_internal(
         cur = inpL;
 
         // norm
-        {
-            wstate.use_buf(ctx0, 0);
-
-            cur = ggml_norm(ctx0, cur);
-
-            wstate.use_buf(ctx0, 1);
+        if (!features_inner) {
+            // not in buffers 0 and 1 - the cross-attention graph below reads it while writing to them
+            wstate.use_buf(ctx0, 2);
 
-            // cur = ln_f_g*cur + ln_f_b
-            cur = ggml_add(ctx0,
-                    ggml_mul(ctx0,
-                        ggml_repeat(ctx0, model.e_ln_w, cur),
-                        cur),
-                    ggml_repeat(ctx0, model.e_ln_b, cur));
+            // cur = ln_f_g*norm(cur) + ln_f_b
+            cur = ggml_norm_affine(ctx0, cur, model.e_ln_w, model.e_ln_b);
         }
 
         wstate.use_buf(ctx0, -1);
 
+        // the last node writes the features straight into the caller's buffer
+        if (features_out != nullptr) {
+            ggml_set_no_alloc(ctx0, true);
+            struct ggml_tensor * out = ggml_new_tensor_2d(ctx0, GGML_TYPE_F32, n_state, n_ctx);
+            ggml_set_no_alloc(ctx0, false);
+
+            out->data = features_out;
+
+            cur = ggml_cpy(ctx0, cur, out);
+        }
+
         // run the computation
         {
-            struct ggml_cgraph gf = {};
-            gf.n_threads = n_threads;
-
             ggml_build_forward_expand(&gf, cur);
             ggml_graph_compute(ctx0, &gf);
 
@@ -1769,6 +2437,8 @@ static bool whisper_encode_internal(
     {
         wstate.use_buf(ctx0, -1);
 
+        struct ggml_tensor * mel = whisper_encode_mel_window(ctx0, mel_inp, offsets[0], n_ctx, false);
+
         cur = ggml_new_tensor_2d(ctx0, GGML_TYPE_F32, n_state, n_ctx);
 
         whisper_coreml_encode(wstate.ctx_coreml, (float *) mel->data, (float *) cur->data);
@@ -1789,6 +2459,21 @@ static bool whisper_encode_internal(
     //    Rprintf("\n");
     //}
 
+    if (features) {
+        if (features_out != nullptr && cur->data != features_out) {
+            memcpy(features_out, cur->data, ggml_nbytes(cur));
+        }
+
+        wstate.features = features_out != nullptr ? features_out : (const float *) cur->data;
+
+        ggml_free(ctx0);
+
+        wstate.t_encode_us += ggml_time_us() - t_start_us;
+        wstate.n_encode++;
+
+        return true;
+    }
+
     // pre-compute cross-attention memory
     {
         struct ggml_cgraph gf = {};
@@ -1799,7 +2484,41 @@ static bool whisper_encode_internal(
         cur->src0 = nullptr;
         cur->src1 = nullptr;
 
-        for (int il = 0; il < model.hparams.n_text_layer; ++il) {
+        const ggml_type kv_type = wstate.kv_cross.k->type;
+
+        // positions per layer and size of a row of K (n_state values) and of V (n_pad values)
+        const int n_pad = kv_cross_n_pad(kv_type, n_ctx);
+
+        const size_t nb_k = ggml_type_size(kv_type)*n_state/ggml_blck_size(kv_type);
+        const size_t nb_v = ggml_type_size(kv_type)*n_pad/ggml_blck_size(kv_type);
+
+        // the destination of the cross-attention KV cache of each window
+        std::vector<struct ggml_tensor *> kv_k(n_batch_cur);
+        std::vector<struct ggml_tensor *> kv_v(n_batch_cur);
+
+        for (int b = 0; b < n_batch_cur; ++b) {
+            if (slots[b] == nullptr) {
+                kv_k[b] = wstate.kv_cross.k;
+                kv_v[b] = wstate.kv_cross.v;
+            } else {
+                ggml_set_no_alloc(ctx0, true);
+                kv_k[b] = ggml_new_tensor_1d(ctx0, kv_type, n_text_layer*n_pad*n_state);
+                kv_v[b] = ggml_new_tensor_1d(ctx0, kv_type, n_text_layer*n_pad*n_state);
+                ggml_set_no_alloc(ctx0, false);
+
+                kv_k[b]->data = slots[b]->k.data();
+                kv_v[b]->data = slots[b]->v.data();
+            }
+        }
+
+        // a quantized V is written from whole transposed rows - they are assembled here, with zero padding
+        // the buffer is shared by all layers and windows, as the copies run one after another
+        struct ggml_tensor * V_pad = nullptr;
+        if (ggml_is_quantized(kv_type)) {
+            V_pad = ggml_set_zero(ggml_new_tensor_2d(ctx0, GGML_TYPE_F32, n_pad, n_state));
+        }
+
+        for (int il = 0; il < n_text_layer; ++il) {
             auto& layer = model.layers_decoder[il];
 
             wstate.use_buf(ctx0, 0);
@@ -1812,27 +2531,34 @@ static bool whisper_encode_internal(
 
             wstate.use_buf(ctx0, 1);
 
-            struct ggml_tensor* Vcross = ggml_mul_mat(ctx0,
+            struct ggml_tensor* Vcross = ggml_mul_mat_bias(ctx0,
                 layer.cross_attn_v_w,
-                cur);
-
-            Vcross = ggml_add(ctx0,
-                ggml_repeat(ctx0,
-                    layer.cross_attn_v_b,
-                    Vcross),
-                Vcross);
+                cur,
+                layer.cross_attn_v_b);
 
             wstate.use_buf(ctx0, -1);
 
-            Vcross = ggml_transpose(ctx0, ggml_reshape_2d(ctx0, Vcross, n_state, n_ctx));
+            for (int b = 0; b < n_batch_cur; ++b) {
+                struct ggml_tensor * Kcross_b = ggml_view_2d(ctx0, Kcross, n_state, n_ctx, Kcross->nb[1], b*n_ctx*Kcross->nb[1]);
+                struct ggml_tensor * Vcross_b = ggml_transpose(ctx0, ggml_view_2d(ctx0, Vcross, n_state, n_ctx, Vcross->nb[1], b*n_ctx*Vcross->nb[1]));
+
+                struct ggml_tensor * k = ggml_view_2d(ctx0, kv_k[b], n_state, n_ctx, nb_k, nb_k*il*n_pad);
+
+                ggml_build_forward_expand(&gf, ggml_cpy(ctx0, Kcross_b, k));
+
+                if (V_pad == nullptr) {
+                    struct ggml_tensor * v = ggml_view_2d(ctx0, kv_v[b], n_ctx, n_state, nb_v, nb_v*il*n_state);
+
+                    ggml_build_forward_expand(&gf, ggml_cpy(ctx0, Vcross_b, v));
+                } else {
+                    struct ggml_tensor * v = ggml_view_2d(ctx0, kv_v[b], n_pad, n_state, nb_v, nb_v*il*n_state);
 
-            struct ggml_tensor * k = ggml_view_1d(ctx0, wstate.kv_cross.k, n_state*n_ctx, (ggml_element_size(wstate.kv_cross.k)*n_state)*(il*n_ctx));
-            struct ggml_tensor * v = ggml_view_2d(ctx0, wstate.kv_cross.v, n_ctx, n_state,
-                    (   n_ctx)*ggml_element_size(wstate.kv_cross.v),
-                    (il*n_ctx)*ggml_element_size(wstate.kv_cross.v)*n_state);
+                    Vcross_b = ggml_cpy(ctx0, Vcross_b, ggml_view_2d(ctx0, V_pad, n_ctx, n_state, V_pad->nb[1], 0));
 
-            ggml_build_forward_expand(&gf, ggml_cpy(ctx0, Kcross, k));
-            ggml_build_forward_expand(&gf, ggml_cpy(ctx0, Vcross, v));
+                    // the copy into V_pad is the source of this copy through its view of V_pad
+                    ggml_build_forward_expand(&gf, ggml_cpy(ctx0, ggml_view_2d(ctx0, Vcross_b, n_pad, n_state, V_pad->nb[1], 0), v));
+                }
+            }
         }
 
         ggml_graph_compute(ctx0, &gf);
@@ -1850,70 +2576,188 @@ static bool whisper_encode_internal(
 
     ggml_free(ctx0);
 
+    if (slots[0] == nullptr) {
+        whisper_cache_put_encode(wstate, offsets[0], n_ctx, n_text_layer, n_state);
+    }
+
     wstate.t_encode_us += ggml_time_us() - t_start_us;
-    wstate.n_encode++;
+    wstate.n_encode += n_batch_cur;
 
     return true;
 }
 
-// evaluate the decoder
+static bool whisper_encode_internal(
+        whisper_context & wctx,
+          whisper_state & wstate,
+              const int   mel_offset,
+              const int   n_threads) {
+    return whisper_encode_batch_internal(wctx, wstate, &mel_offset, 1, n_threads, false, nullptr, -1);
+}
+
+
+// evaluate the decoder for a batch of sequences
 //
-// given text prompt + audio features -> computes the logits for the next token
+// given text prompts + audio features -> computes the logits for the next token of each sequence
+// the sequences share the weights and the cross-attention KV cache, so a whole batch costs about one pass
+// over the weights - each sequence has its own self-attention KV cache and position
 //
 //   - model:      the model
 //   - n_threads:  number of threads to use
-//   - tokens:     text prompt
-//   - n_tokens:   number of tokens in the prompt
-//   - n_past:     number of past tokens to prefix the prompt with
+//   - states:     the state of each sequence - its self-attention and cross-attention KV caches [n_batch]
+//                 (the sequences of a state are consecutive)
+//   - decoders:   the decoders that own the self-attention KV caches [n_batch]
+//   - tokens:     text prompts [n_batch][n_tokens]
+//   - n_tokens:   number of tokens in each prompt
+//   - n_past:     number of past tokens to prefix each prompt with [n_batch]
+//   - n_batch:    number of sequences
+//   - logits_all: compute the logits for all tokens instead of only the last one
 //
-static bool whisper_decode_internal(
+// the graph is evaluated with the buffers of wstate and the logits are stored in wstate.logits [n_batch][n_vocab],
+// or [n_batch][n_tokens][n_vocab] with logits_all
+//
+static bool whisper_decode_batch_internal(
         whisper_context & wctx,
           whisper_state & wstate,
-        whisper_decoder & decoder,
+        whisper_state ** states,
+      whisper_decoder ** decoders,
     const whisper_token * tokens,
               const int   n_tokens,
-              const int   n_past,
-              const int   n_threads) {
-    const int64_t t_start_us = ggml_time_us();
-
+              const int * n_past,
+              const int   n_batch,
+              const int   n_threads,
+             const bool   logits_all) {
     const auto & model   = wctx.model;
     const auto & hparams = model.hparams;
 
-    auto & kv_self = decoder.kv_self;
-
-    WHISPER_ASSERT(!!kv_self.ctx);
-
     auto & logits_out = wstate.logits;
 
     const int n_vocab = hparams.n_vocab;
 
-    const int n_ctx   = hparams.n_text_ctx;
     const int n_state = hparams.n_text_state;
     const int n_head  = hparams.n_text_head;
     const int n_layer = hparams.n_text_layer;
 
     const int N = n_tokens;
-    const int M = wstate.exp_n_audio_ctx > 0 ? wstate.exp_n_audio_ctx : hparams.n_audio_ctx;
 
-    //WHISPER_PRINT_DEBUG("%s: n_past = %d, N = %d, M = %d, n_ctx = %d\n", __func__, n_past, N, M, n_ctx);
+    // the self-attention adds nodes to the graph for every sequence in every layer
+    // split large batches so that the graph stays within GGML_MAX_NODES
+    const int n_batch_max = std::max(1, GGML_MAX_NODES/(WHISPER_DECODE_NODES_PER_SEQ*n_layer));
 
-    struct ggml_init_params params = {
-        /*.mem_size   =*/ wstate.buf_compute.size(),
-        /*.mem_buffer =*/ wstate.buf_compute.data(),
-        /*.no_alloc   =*/ false,
-    };
+    if (n_batch > n_batch_max) {
+        std::vector<float> logits_chunks;
+        logits_chunks.reserve(n_batch*(logits_all ? N : 1)*n_vocab);
 
-    struct ggml_context * ctx0 = ggml_init(params);
+        for (int b0 = 0; b0 < n_batch; b0 += n_batch_max) {
+            const int n_batch_cur = std::min(n_batch_max, n_batch - b0);
 
-    struct ggml_cgraph gf = {};
+            if (!whisper_decode_batch_internal(wctx, wstate, states + b0, decoders + b0, tokens + b0*N, N, n_past + b0, n_batch_cur, n_threads, logits_all)) {
+                return false;
+            }
+
+            logits_chunks.insert(logits_chunks.end(), logits_out.begin(), logits_out.end());
+        }
+
+        logits_out.swap(logits_chunks);
+
+        return true;
+    }
+
+    const int64_t t_start_us = ggml_time_us();
+
+    // make room for the new tokens in the self-attention KV cache
+    for (int b = 0; b < n_batch; ++b) {
+        auto & kv_pool = states[b]->kv_pool;
+
+        WHISPER_ASSERT(!!kv_pool.cache.ctx);
+
+        if (!kv_pages_prepare(hparams, kv_pool, decoders[b]->kv_self, n_past[b], N)) {
+            Rprintf("%s: failed to map %d tokens after %d past tokens in the self-attention cache\n", __func__, N, n_past[b]);
+            return false;
+        }
+    }
+
+    // the sequences of a state share its cross-attention KV cache - [b0, b1) of each run of the same state
+    std::vector<std::pair<int, int>> runs;
+    for (int b = 0; b < n_batch; ++b) {
+        if (runs.empty() || states[b] != states[runs.back().first]) {
+            runs.emplace_back(b, b);
+        }
+        runs.back().second = b + 1;
+    }
+
+    //WHISPER_PRINT_DEBUG("%s: n_past = %d, N = %d, n_batch = %d\n", __func__, n_past[0], N, n_batch);
+
+    struct ggml_init_params params = {
+        /*.mem_size   =*/ wstate.buf_compute.size(),
+        /*.mem_buffer =*/ wstate.buf_compute.data(),
+        /*.no_alloc   =*/ false,
+    };
+
+    struct ggml_context * ctx0 = ggml_init(params);
+
+    struct ggml_cgraph gf = {};
     gf.n_threads = n_threads;
 
-    struct ggml_tensor * embd = ggml_new_tensor_1d(ctx0, GGML_TYPE_I32, N);
-    memcpy(embd->data, tokens, N*ggml_element_size(embd));
+    struct ggml_tensor * embd = ggml_new_tensor_1d(ctx0, GGML_TYPE_I32, N*n_batch);
+    memcpy(embd->data, tokens, N*n_batch*ggml_element_size(embd));
+
+    struct ggml_tensor * position = ggml_new_tensor_1d(ctx0, GGML_TYPE_I32, N*n_batch);
+    for (int b = 0; b < n_batch; ++b) {
+        for (int i = 0; i < N; ++i) {
+            ((int32_t *) position->data)[b*N + i] = n_past[b] + i;
+        }
+    }
+
+    // [EXPERIMENTAL] restricted vocabulary: the output projection uses only the rows of d_te of the allowed tokens,
+    // gathered without conversion so that the logits are the same as with the full projection
+    // (for a large part of the vocabulary, or states with different vocabularies, the full projection is computed and masked)
+    const auto & allowed = states[0]->exp_vocab_allowed;
+
+    bool vocab_same = true;
+    for (const auto & run : runs) {
+        vocab_same = vocab_same && states[run.first]->exp_vocab_allowed == allowed;
+    }
+
+    struct ggml_tensor * vocab_idx = nullptr;
+    if (vocab_same && !allowed.empty() && 4*allowed.size() < (size_t) n_vocab) {
+        vocab_idx = ggml_new_tensor_1d(ctx0, GGML_TYPE_I32, allowed.size());
+        memcpy(vocab_idx->data, allowed.data(), allowed.size()*ggml_element_size(vocab_idx));
+    }
+
+    // the self-attention of a sequence reads its KV cache in place when its blocks are consecutive in the pool
+    // otherwise the blocks are gathered with these indices:
+    //   - idx_k: rows of the [WHISPER_KV_BLOCK_SIZE*n_state, n_block] view of a layer of K
+    //   - idx_v: rows of the [WHISPER_KV_BLOCK_SIZE, n_state*n_block] view of a layer of V
+    std::vector<struct ggml_tensor *> idx_k(n_batch, nullptr);
+    std::vector<struct ggml_tensor *> idx_v(n_batch, nullptr);
+
+    for (int b = 0; b < n_batch; ++b) {
+        const auto & kv_pool = states[b]->kv_pool;
+        const auto & blocks  = decoders[b]->kv_self.blocks;
+
+        const int n_tbl = (n_past[b] + N + WHISPER_KV_BLOCK_SIZE - 1)/WHISPER_KV_BLOCK_SIZE;
+
+        bool consecutive = true;
+        for (int t = 1; t < n_tbl; ++t) {
+            consecutive = consecutive && blocks[t] == blocks[0] + t;
+        }
+
+        if (consecutive) {
+            continue;
+        }
+
+        idx_k[b] = ggml_new_tensor_1d(ctx0, GGML_TYPE_I32, n_tbl);
+        idx_v[b] = ggml_new_tensor_1d(ctx0, GGML_TYPE_I32, n_state*n_tbl);
+
+        for (int t = 0; t < n_tbl; ++t) {
+            ((int32_t *) idx_k[b]->data)[t] = blocks[t];
+        }
 
-    struct ggml_tensor * position = ggml_new_tensor_1d(ctx0, GGML_TYPE_I32, N);
-    for (int i = 0; i < N; ++i) {
-        ((int32_t *) position->data)[i] = n_past + i;
+        for (int i = 0; i < n_state; ++i) {
+            for (int t = 0; t < n_tbl; ++t) {
+                ((int32_t *) idx_v[b]->data)[i*n_tbl + t] = i*kv_pool.n_block + blocks[t];
+            }
+        }
     }
 
     wstate.use_buf(ctx0, 3);
@@ -1926,6 +2770,9 @@ static bool whisper_decode_internal(
 
     struct ggml_tensor * inpL = cur;
 
+    // rows of the hidden state - all tokens, until only the last token of each sequence is needed (see below)
+    int n_tok = N*n_batch;
+
     for (int il = 0; il < n_layer; ++il) {
         const auto & layer = model.layers_decoder[il];
 
@@ -1933,29 +2780,17 @@ static bool whisper_decode_internal(
         {
             wstate.use_buf(ctx0, 0);
 
-            cur = ggml_norm(ctx0, inpL);
-
-            // cur = ln_0_w*cur + ln_0_b
-            cur = ggml_add(ctx0,
-                    ggml_mul(ctx0,
-                        ggml_repeat(ctx0, layer.attn_ln_0_w, cur),
-                        cur),
-                    ggml_repeat(ctx0, layer.attn_ln_0_b, cur));
+            // cur = ln_0_w*norm(inpL) + ln_0_b
+            cur = ggml_norm_affine(ctx0, inpL, layer.attn_ln_0_w, layer.attn_ln_0_b);
         }
 
         // self-attention
         {
-            struct ggml_tensor * Qcur = ggml_mul_mat(ctx0,
+            struct ggml_tensor * Qcur = ggml_mul_mat_bias_scale(ctx0,
                     layer.attn_q_w,
-                    cur);
-
-            Qcur = ggml_add(ctx0,
-                    ggml_repeat(ctx0,
-                        layer.attn_q_b,
-                        Qcur),
-                    Qcur);
-
-            Qcur = ggml_scale_inplace(ctx0, Qcur, ggml_new_f32(ctx0, pow(float(n_state)/n_head, -0.25)));
+                    cur,
+                    layer.attn_q_b,
+                    ggml_new_f32(ctx0, pow(float(n_state)/n_head, -0.25)));
 
             // note: no bias for Key
             struct ggml_tensor * Kcur = ggml_mul_mat(ctx0,
@@ -1966,89 +2801,164 @@ static bool whisper_decode_internal(
 
             // store key and value to memory
             {
-                struct ggml_tensor * Vcur = ggml_mul_mat(ctx0,
+                struct ggml_tensor * Vcur = ggml_mul_mat_bias(ctx0,
                         layer.attn_v_w,
-                        cur);
+                        cur,
+                        layer.attn_v_b);
 
-                Vcur = ggml_add(ctx0,
-                        ggml_repeat(ctx0,
-                            layer.attn_v_b,
-                            Vcur),
-                        Vcur);
+                for (int b = 0; b < n_batch; ++b) {
+                    const auto & kv_pool = states[b]->kv_pool;
+                    const auto & kv_self = decoders[b]->kv_self;
 
-                Vcur = ggml_transpose(ctx0, ggml_reshape_2d(ctx0, Vcur, n_state, N));
+                    const int n_rows = kv_pool.n_block*WHISPER_KV_BLOCK_SIZE; // rows of the pool per layer
 
-                struct ggml_tensor * k = ggml_view_1d(ctx0, kv_self.k, N*n_state, (ggml_element_size(kv_self.k)*n_state)*(il*n_ctx + n_past));
-                struct ggml_tensor * v = ggml_view_2d(ctx0, kv_self.v, N, n_state,
-                        (   n_ctx)*ggml_element_size(kv_self.v),
-                        (il*n_ctx)*ggml_element_size(kv_self.v)*n_state + n_past*ggml_element_size(kv_self.v));
+                    const size_t kv_es = ggml_element_size(kv_pool.cache.k);
 
-                ggml_build_forward_expand(&gf, ggml_cpy(ctx0, Kcur, k));
-                ggml_build_forward_expand(&gf, ggml_cpy(ctx0, Vcur, v));
+                    const int p_end = n_past[b] + N;
+
+                    // one copy per run of positions that are in consecutive rows of the pool
+                    for (int p0 = n_past[b], p1 = 0; p0 < p_end; p0 = p1) {
+                        const int row0 = kv_pages_row(kv_self, p0);
+
+                        for (p1 = p0 + 1; p1 < p_end && kv_pages_row(kv_self, p1) == row0 + (p1 - p0); ++p1) {
+                        }
+
+                        const int n_run = p1 - p0;
+                        const int i_run = b*N + (p0 - n_past[b]);
+
+                        struct ggml_tensor * Kb = ggml_view_1d(ctx0, Kcur, n_run*n_state, i_run*Kcur->nb[1]);
+                        struct ggml_tensor * Vb = ggml_transpose(ctx0, ggml_view_2d(ctx0, Vcur, n_state, n_run, Vcur->nb[1], i_run*Vcur->nb[1]));
+
+                        struct ggml_tensor * k = ggml_view_1d(ctx0, kv_pool.cache.k, n_run*n_state, (kv_es*n_state)*((size_t) il*n_rows + row0));
+                        struct ggml_tensor * v = ggml_view_2d(ctx0, kv_pool.cache.v, n_run, n_state,
+                                (      n_rows)*kv_es,
+                                (il*n_rows)*kv_es*n_state + row0*kv_es);
+
+                        ggml_build_forward_expand(&gf, ggml_cpy(ctx0, Kb, k));
+                        ggml_build_forward_expand(&gf, ggml_cpy(ctx0, Vb, v));
+                    }
+                }
             }
 
             // ------
 
-            wstate.use_buf(ctx0, 0);
+            wstate.use_buf(ctx0, 2);
 
-            struct ggml_tensor * Q =
-                ggml_permute(ctx0,
-                        ggml_cpy(ctx0,
-                            Qcur,
-                            ggml_new_tensor_3d(ctx0, GGML_TYPE_F32, n_state/n_head, n_head, N)),
-                        0, 2, 1, 3);
+            // cur = KQV_merged.contiguous().view(n_state, N) for each sequence
+            cur = ggml_new_tensor_2d(ctx0, GGML_TYPE_F32, n_state, N*n_batch);
+
+            // each sequence attends to its own KV cache
+            // the nodes of a sequence are expanded before the next one is built, so they can reuse the scratch buffers
+            for (int b = 0; b < n_batch; ++b) {
+                const auto & kv_pool = states[b]->kv_pool;
+                const auto & kv_self = decoders[b]->kv_self;
+
+                const int n_rows = kv_pool.n_block*WHISPER_KV_BLOCK_SIZE;
+
+                const size_t kv_es = ggml_element_size(kv_pool.cache.k);
+
+                const int n_kv  = n_past[b] + N;
+                const int n_tbl = (n_kv + WHISPER_KV_BLOCK_SIZE - 1)/WHISPER_KV_BLOCK_SIZE;
+
+                wstate.use_buf(ctx0, 0);
+
+                struct ggml_tensor * Q =
+                    ggml_permute(ctx0,
+                            ggml_cpy(ctx0,
+                                ggml_view_2d(ctx0, Qcur, n_state, N, Qcur->nb[1], b*N*Qcur->nb[1]),
+                                ggml_new_tensor_3d(ctx0, GGML_TYPE_F32, n_state/n_head, n_head, N)),
+                            0, 2, 1, 3);
+
+                wstate.use_buf(ctx0, 1);
+
+                struct ggml_tensor * K = nullptr;
+                struct ggml_tensor * V = nullptr;
+
+                if (idx_k[b] == nullptr) {
+                    const int row0 = kv_self.blocks[0]*WHISPER_KV_BLOCK_SIZE;
+
+                    K = ggml_view_1d(ctx0, kv_pool.cache.k, n_kv*n_state, (kv_es*n_state)*((size_t) il*n_rows + row0));
 
-            struct ggml_tensor * K =
-                ggml_permute(ctx0,
-                        ggml_reshape_3d(ctx0,
-                            ggml_view_1d(ctx0, kv_self.k, (n_past + N)*n_state, il*n_ctx*ggml_element_size(kv_self.k)*n_state),
-                            n_state/n_head, n_head, n_past + N),
+                    V = ggml_view_3d(ctx0, kv_pool.cache.v,
+                            n_kv, n_state/n_head, n_head,
+                            n_rows*kv_es,
+                            n_rows*kv_es*n_state/n_head,
+                            il*n_rows*kv_es*n_state + row0*kv_es);
+                } else {
+                    struct ggml_tensor * K_blocks =
+                        ggml_get_rows_raw(ctx0,
+                                ggml_view_2d(ctx0, kv_pool.cache.k, WHISPER_KV_BLOCK_SIZE*n_state, kv_pool.n_block,
+                                    WHISPER_KV_BLOCK_SIZE*n_state*kv_es,
+                                    il*n_rows*kv_es*n_state),
+                                idx_k[b]);
+
+                    struct ggml_tensor * V_blocks =
+                        ggml_get_rows_raw(ctx0,
+                                ggml_view_2d(ctx0, kv_pool.cache.v, WHISPER_KV_BLOCK_SIZE, n_state*kv_pool.n_block,
+                                    WHISPER_KV_BLOCK_SIZE*kv_es,
+                                    il*n_rows*kv_es*n_state),
+                                idx_v[b]);
+
+                    K = ggml_view_1d(ctx0, K_blocks, n_kv*n_state, 0);
+
+                    V = ggml_view_3d(ctx0, V_blocks,
+                            n_kv, n_state/n_head, n_head,
+                            n_tbl*WHISPER_KV_BLOCK_SIZE*kv_es,
+                            n_tbl*WHISPER_KV_BLOCK_SIZE*kv_es*n_state/n_head,
+                            0);
+                }
+
+                K = ggml_permute(ctx0,
+                        ggml_reshape_3d(ctx0, K, n_state/n_head, n_head, n_kv),
                         0, 2, 1, 3);
 
-            wstate.use_buf(ctx0, 1);
+                // K * Q
+                struct ggml_tensor * KQ = ggml_mul_mat(ctx0, K, Q);
 
-            // K * Q
-            struct ggml_tensor * KQ = ggml_mul_mat(ctx0, K, Q);
+                //struct ggml_tensor * KQ_scaled =
+                //    ggml_scale_inplace(ctx0,
+                //            KQ,
+                //            ggml_new_f32(ctx0, 1.0f/sqrt(float(n_state)/n_head))
+                //            );
 
-            //struct ggml_tensor * KQ_scaled =
-            //    ggml_scale_inplace(ctx0,
-            //            KQ,
-            //            ggml_new_f32(ctx0, 1.0f/sqrt(float(n_state)/n_head))
-            //            );
+                struct ggml_tensor * KQ_masked = ggml_diag_mask_inf_inplace(ctx0, KQ, n_past[b]);
 
-            struct ggml_tensor * KQ_masked = ggml_diag_mask_inf_inplace(ctx0, KQ, n_past);
+                struct ggml_tensor * KQ_soft_max = ggml_soft_max_inplace(ctx0, KQ_masked);
 
-            struct ggml_tensor * KQ_soft_max = ggml_soft_max_inplace(ctx0, KQ_masked);
+                struct ggml_tensor * KQV = ggml_mul_mat(ctx0, V, KQ_soft_max);
 
-            struct ggml_tensor * V =
-                ggml_view_3d(ctx0, kv_self.v,
-                        n_past + N, n_state/n_head, n_head,
-                        n_ctx*ggml_element_size(kv_self.v),
-                        n_ctx*ggml_element_size(kv_self.v)*n_state/n_head,
-                        il*n_ctx*ggml_element_size(kv_self.v)*n_state);
+                struct ggml_tensor * KQV_merged = ggml_permute(ctx0, KQV, 0, 2, 1, 3);
 
-            struct ggml_tensor * KQV = ggml_mul_mat(ctx0, V, KQ_soft_max);
+                ggml_build_forward_expand(&gf, ggml_cpy(ctx0,
+                            KQV_merged,
+                            ggml_view_2d(ctx0, cur, n_state, N, cur->nb[1], b*N*cur->nb[1])));
+            }
+        }
 
-            struct ggml_tensor * KQV_merged = ggml_permute(ctx0, KQV, 0, 2, 1, 3);
+        // the keys and values of the last layer are in the cache - the rest of it is evaluated only for the
+        // token whose logits are computed (the last one of each sequence), unless all of them are needed
+        if (il == n_layer - 1 && !logits_all && N > 1) {
+            wstate.use_buf(ctx0, 1);
 
             cur = ggml_cpy(ctx0,
-                    KQV_merged,
-                    ggml_new_tensor_2d(ctx0, GGML_TYPE_F32, n_state, N));
+                    ggml_view_2d(ctx0, cur, n_state, n_batch, N*cur->nb[1], (N - 1)*cur->nb[1]),
+                    ggml_new_tensor_2d(ctx0, GGML_TYPE_F32, n_state, n_batch));
+
+            inpL = ggml_cpy(ctx0,
+                    ggml_view_2d(ctx0, inpL, n_state, n_batch, N*inpL->nb[1], (N - 1)*inpL->nb[1]),
+                    ggml_new_tensor_2d(ctx0, GGML_TYPE_F32, n_state, n_batch));
+
+            n_tok = n_batch;
         }
 
         // projection
         {
             wstate.use_buf(ctx0, 0);
 
-            cur = ggml_mul_mat(ctx0,
+            cur = ggml_mul_mat_bias(ctx0,
                     layer.attn_ln_1_w,
-                    cur);
-
-            wstate.use_buf(ctx0, 1);
-
-            cur = ggml_add(ctx0,
-                    ggml_repeat(ctx0, layer.attn_ln_1_b, cur),
-                    cur);
+                    cur,
+                    layer.attn_ln_1_b);
         }
 
         wstate.use_buf(ctx0, 2);
@@ -2060,101 +2970,123 @@ static bool whisper_decode_internal(
         {
             wstate.use_buf(ctx0, 0);
 
-            cur = ggml_norm(ctx0, inpCA); // note: we use inpCA here
-
-            // cur = ln_0_w*cur + ln_0_b
-            cur = ggml_add(ctx0,
-                    ggml_mul(ctx0,
-                        ggml_repeat(ctx0, layer.cross_attn_ln_0_w, cur),
-                        cur),
-                    ggml_repeat(ctx0, layer.cross_attn_ln_0_b, cur));
+            // cur = ln_0_w*norm(inpCA) + ln_0_b
+            cur = ggml_norm_affine(ctx0, inpCA, layer.cross_attn_ln_0_w, layer.cross_attn_ln_0_b); // note: we use inpCA here
         }
 
         // cross-attention
         {
-            struct ggml_tensor * Qcur = ggml_mul_mat(ctx0,
+            struct ggml_tensor * Qcur = ggml_mul_mat_bias_scale(ctx0,
                     layer.cross_attn_q_w,
-                    cur);
+                    cur,
+                    layer.cross_attn_q_b,
+                    ggml_new_f32(ctx0, pow(float(n_state)/n_head, -0.25)));
 
-            Qcur = ggml_add(ctx0,
-                    ggml_repeat(ctx0,
-                        layer.cross_attn_q_b,
-                        Qcur),
-                    Qcur);
-
-            Qcur = ggml_scale_inplace(ctx0, Qcur, ggml_new_f32(ctx0, pow(float(n_state)/n_head, -0.25)));
-
-            // Kcross is already scaled
-            struct ggml_tensor * Kcross =
-                ggml_reshape_3d(ctx0,
-                        ggml_view_1d(ctx0, wstate.kv_cross.k, M*n_state, il*M*ggml_element_size(wstate.kv_cross.k)*n_state),
-                        n_state/n_head, n_head, M);
-
-            //struct ggml_tensor * Vcross =
-            //    ggml_reshape_3d(ctx0,
-            //            ggml_view_1d(ctx0, wstate.kv_cross.v, M*n_state, il*M*ggml_element_size(wstate.kv_cross.v)*n_state),
-            //            n_state/n_head, n_head, M);
-
-            //struct ggml_tensor * V_trans =
-            //    ggml_cpy(ctx0,
-            //            ggml_permute(ctx0, Vcross, 1, 2, 0, 3),
-            //            ggml_new_tensor_3d(ctx0, Vcross->type, M, n_state/n_head, n_head));
-
-            struct ggml_tensor * V =
-                ggml_view_3d(ctx0, wstate.kv_cross.v,
-                        M, n_state/n_head, n_head,
-                        M*ggml_element_size(wstate.kv_cross.v),
-                        M*ggml_element_size(wstate.kv_cross.v)*n_state/n_head,
-                        il*M*ggml_element_size(wstate.kv_cross.v)*n_state);
+            // the sequences of a state attend to its audio together, in one run
+            const int n_tok_seq = n_tok/n_batch;
 
-            // ------
+            struct ggml_tensor * KQV_runs = runs.size() == 1 ? nullptr : ggml_new_tensor_2d(ctx0, GGML_TYPE_F32, n_state, n_tok);
 
-            struct ggml_tensor * Q =
-                ggml_permute(ctx0,
-                        ggml_cpy(ctx0,
-                            Qcur,
-                            ggml_new_tensor_3d(ctx0, GGML_TYPE_F32, n_state/n_head, n_head, N)),
-                        0, 2, 1, 3);
+            for (const auto & run : runs) {
+                const auto & rstate = *states[run.first];
 
-            struct ggml_tensor * K = ggml_permute(ctx0, Kcross, 0, 2, 1, 3);
+                const int M = rstate.exp_n_audio_ctx > 0 ? rstate.exp_n_audio_ctx : hparams.n_audio_ctx;
 
-            // K * Q
-            struct ggml_tensor * KQ = ggml_mul_mat(ctx0, K, Q);
+                // the cross-attention attends to M_pad positions, the padding of a quantized cache is masked out
+                const ggml_type kv_cross_type = rstate.kv_cross.k->type;
 
-            //struct ggml_tensor * KQ_scaled =
-            //    ggml_scale_inplace(ctx0,
-            //            KQ,
-            //            ggml_new_f32(ctx0, 1.0f/sqrt(float(n_state)/n_head))
-            //            );
+                const int M_pad = kv_cross_n_pad(kv_cross_type, M);
 
-            // no masking for cross-attention
-            //struct ggml_tensor * KQ_masked = ggml_diag_mask_inf_inplace(ctx0, KQ_scaled, n_past);
+                const size_t nb_k_cross = ggml_type_size(kv_cross_type)*n_state/ggml_blck_size(kv_cross_type);
+                const size_t nb_v_cross = ggml_type_size(kv_cross_type)*M_pad/ggml_blck_size(kv_cross_type);
 
-            struct ggml_tensor * KQ_soft_max = ggml_soft_max_inplace(ctx0, KQ);
+                const int n_tok_run = (run.second - run.first)*n_tok_seq;
 
-            struct ggml_tensor * KQV = ggml_mul_mat(ctx0, V, KQ_soft_max);
+                // Kcross is already scaled
+                struct ggml_tensor * Kcross =
+                    ggml_reshape_3d(ctx0,
+                            ggml_view_1d(ctx0, rstate.kv_cross.k, M_pad*n_state, il*M_pad*nb_k_cross),
+                            n_state/n_head, n_head, M_pad);
 
-            struct ggml_tensor * KQV_merged = ggml_permute(ctx0, KQV, 0, 2, 1, 3);
+                //struct ggml_tensor * Vcross =
+                //    ggml_reshape_3d(ctx0,
+                //            ggml_view_1d(ctx0, wstate.kv_cross.v, M*n_state, il*M*ggml_element_size(wstate.kv_cross.v)*n_state),
+                //            n_state/n_head, n_head, M);
 
-            // cur = KQV_merged.contiguous().view(n_state, N)
-            cur = ggml_cpy(ctx0,
-                    KQV_merged,
-                    ggml_new_tensor_2d(ctx0, GGML_TYPE_F32, n_state, N));
+                //struct ggml_tensor * V_trans =
+                //    ggml_cpy(ctx0,
+                //            ggml_permute(ctx0, Vcross, 1, 2, 0, 3),
+                //            ggml_new_tensor_3d(ctx0, Vcross->type, M, n_state/n_head, n_head));
+
+                struct ggml_tensor * V =
+                    ggml_view_3d(ctx0, rstate.kv_cross.v,
+                            M_pad, n_state/n_head, n_head,
+                            nb_v_cross,
+                            nb_v_cross*n_state/n_head,
+                            nb_v_cross*n_state*il);
+
+                // ------
+
+                struct ggml_tensor * Q =
+                    ggml_permute(ctx0,
+                            ggml_cpy(ctx0,
+                                ggml_view_2d(ctx0, Qcur, n_state, n_tok_run, Qcur->nb[1], run.first*n_tok_seq*Qcur->nb[1]),
+                                ggml_new_tensor_3d(ctx0, GGML_TYPE_F32, n_state/n_head, n_head, n_tok_run)),
+                            0, 2, 1, 3);
+
+                struct ggml_tensor * K = ggml_permute(ctx0, Kcross, 0, 2, 1, 3);
+
+                // K * Q
+                struct ggml_tensor * KQ = ggml_mul_mat(ctx0, K, Q);
+
+                //struct ggml_tensor * KQ_scaled =
+                //    ggml_scale_inplace(ctx0,
+                //            KQ,
+                //            ggml_new_f32(ctx0, 1.0f/sqrt(float(n_state)/n_head))
+                //            );
+
+                // no masking for cross-attention
+                //struct ggml_tensor * KQ_masked = ggml_diag_mask_inf_inplace(ctx0, KQ_scaled, n_past);
+
+                // except for the padding of a quantized cache - viewed as single-row matrices,
+                // diag_mask_inf masks the positions after M - 1 in every row
+                if (M_pad > M) {
+                    KQ = ggml_reshape_3d(ctx0,
+                            ggml_diag_mask_inf_inplace(ctx0, ggml_reshape_3d(ctx0, KQ, M_pad, 1, n_tok_run*n_head), M - 1),
+                            M_pad, n_tok_run, n_head);
+                }
+
+                struct ggml_tensor * KQ_soft_max = ggml_soft_max_inplace(ctx0, KQ);
+
+                struct ggml_tensor * KQV = ggml_mul_mat(ctx0, V, KQ_soft_max);
+
+                struct ggml_tensor * KQV_merged = ggml_permute(ctx0, KQV, 0, 2, 1, 3);
+
+                // cur = KQV_merged.contiguous().view(n_state, n_tok)
+                if (KQV_runs == nullptr) {
+                    cur = ggml_cpy(ctx0,
+                            KQV_merged,
+                            ggml_new_tensor_2d(ctx0, GGML_TYPE_F32, n_state, n_tok));
+                } else {
+                    ggml_build_forward_expand(&gf, ggml_cpy(ctx0,
+                                KQV_merged,
+                                ggml_view_2d(ctx0, KQV_runs, n_state, n_tok_run, KQV_runs->nb[1], run.first*n_tok_seq*KQV_runs->nb[1])));
+                }
+            }
+
+            if (KQV_runs != nullptr) {
+                cur = KQV_runs;
+            }
         }
 
         // projection
         {
             wstate.use_buf(ctx0, 0);
 
-            cur = ggml_mul_mat(ctx0,
+            cur = ggml_mul_mat_bias(ctx0,
                     layer.cross_attn_ln_1_w,
-                    cur);
-
-            wstate.use_buf(ctx0, 1);
-
-            cur = ggml_add(ctx0,
-                    ggml_repeat(ctx0, layer.cross_attn_ln_1_b, cur),
-                    cur);
+                    cur,
+                    layer.cross_attn_ln_1_b);
         }
 
         wstate.use_buf(ctx0, 2);
@@ -2168,50 +3100,27 @@ static bool whisper_decode_internal(
         {
             // norm
             {
-                wstate.use_buf(ctx0, 0);
-
-                cur = ggml_norm(ctx0, inpFF);
-
                 wstate.use_buf(ctx0, 1);
 
-                // cur = mlp_ln_w*cur + mlp_ln_b
-                cur = ggml_add(ctx0,
-                        ggml_mul(ctx0,
-                            ggml_repeat(ctx0, layer.mlp_ln_w, cur),
-                            cur),
-                        ggml_repeat(ctx0, layer.mlp_ln_b, cur));
+                // cur = mlp_ln_w*norm(inpFF) + mlp_ln_b
+                cur = ggml_norm_affine(ctx0, inpFF, layer.mlp_ln_w, layer.mlp_ln_b);
             }
 
             wstate.use_buf(ctx0, 0);
 
-            // fully connected
-            cur = ggml_mul_mat(ctx0,
+            // fully connected + GELU activation
+            cur = ggml_mul_mat_bias_gelu(ctx0,
                     layer.mlp_0_w,
-                    cur);
-
-            wstate.use_buf(ctx0, 1);
-
-            cur = ggml_add(ctx0,
-                    ggml_repeat(ctx0, layer.mlp_0_b, cur),
-                    cur);
-
-            wstate.use_buf(ctx0, 0);
-
-            // GELU activation
-            cur = ggml_gelu(ctx0, cur);
+                    cur,
+                    layer.mlp_0_b);
 
             wstate.use_buf(ctx0, 1);
 
             // projection
-            cur = ggml_mul_mat(ctx0,
+            cur = ggml_mul_mat_bias(ctx0,
                     layer.mlp_1_w,
-                    cur);
-
-            wstate.use_buf(ctx0, 0);
-
-            cur = ggml_add(ctx0,
-                    ggml_repeat(ctx0, layer.mlp_1_b, cur),
-                    cur);
+                    cur,
+                    layer.mlp_1_b);
         }
 
         wstate.use_buf(ctx0, 3);
@@ -2223,27 +3132,24 @@ static bool whisper_decode_internal(
 
     // norm
     {
-        wstate.use_buf(ctx0, 0);
-
-        cur = ggml_norm(ctx0, cur);
-
         wstate.use_buf(ctx0, 1);
 
-        cur = ggml_add(ctx0,
-                ggml_mul(ctx0,
-                    ggml_repeat(ctx0, model.d_ln_w, cur),
-                    cur),
-                ggml_repeat(ctx0, model.d_ln_b, cur));
+        cur = ggml_norm_affine(ctx0, cur, model.d_ln_w, model.d_ln_b);
     }
 
     wstate.use_buf(ctx0, 0);
 
-    // compute logits only for the last token
-    // comment this line to compute logits for all N tokens
-    // might be useful in the future
-    cur = ggml_view_2d(ctx0, cur, cur->ne[0], 1, cur->nb[1], (cur->ne[1] - 1)*cur->nb[1]);
+    // logits only for the last token of each sequence, unless all of them are needed
+    const int n_logits = n_tok;
 
-    struct ggml_tensor * logits = ggml_mul_mat(ctx0, model.d_te, cur);
+    // the rows of d_te are gathered into the scratch buffer after the decoder has run, not before
+    if (vocab_idx != nullptr) {
+        ggml_build_forward_expand(&gf, cur);
+    }
+
+    struct ggml_tensor * logits = vocab_idx == nullptr
+        ? ggml_mul_mat(ctx0, model.d_te, cur)
+        : ggml_mul_mat(ctx0, ggml_get_rows_raw(ctx0, model.d_te, vocab_idx), cur);
 
     wstate.use_buf(ctx0, -1);
 
@@ -2253,13 +3159,33 @@ static bool whisper_decode_internal(
         ggml_graph_compute       (ctx0, &gf);
     }
 
-    // extract logits for all N tokens
-    //logits_out.resize(N*n_vocab);
-    //memcpy(logits_out.data(), ggml_get_data(logits), sizeof(float)*N*n_vocab);
+    if (vocab_same && allowed.empty()) {
+        logits_out.resize(n_logits*n_vocab);
+        memcpy(logits_out.data(), ggml_get_data(logits), sizeof(float)*n_logits*n_vocab);
+    } else {
+        const float * data = (const float *) ggml_get_data(logits);
+
+        const int n_cols = logits->ne[0];
 
-    // extract logits only for the last token
-    logits_out.resize(n_vocab);
-    memcpy(logits_out.data(), ggml_get_data(logits), sizeof(float)*n_vocab);
+        logits_out.resize(n_logits*n_vocab);
+
+        for (int i = 0; i < n_logits; ++i) {
+            const auto & allowed_i = states[i/(n_logits/n_batch)]->exp_vocab_allowed;
+
+            float * out = logits_out.data() + i*n_vocab;
+
+            if (allowed_i.empty()) {
+                memcpy(out, data + i*n_cols, sizeof(float)*n_vocab);
+                continue;
+            }
+
+            std::fill(out, out + n_vocab, -INFINITY);
+
+            for (int j = 0; j < (int) allowed_i.size(); ++j) {
+                out[allowed_i[j]] = data[i*n_cols + (vocab_idx ? j : allowed_i[j])];
+            }
+        }
+    }
 
     if (N > 1) {
         //printf("%s: used_mem = %f MB, %f MB, %f MB %f MB %f MB\n", __func__,
@@ -2278,6 +3204,44 @@ static bool whisper_decode_internal(
     return true;
 }
 
+// evaluate the decoder for a batch of sequences of the same state
+static bool whisper_decode_batch_internal(
+        whisper_context & wctx,
+          whisper_state & wstate,
+      whisper_decoder ** decoders,
+    const whisper_token * tokens,
+              const int   n_tokens,
+              const int * n_past,
+              const int   n_batch,
+              const int   n_threads,
+             const bool   logits_all) {
+    std::vector<whisper_state *> states(n_batch, &wstate);
+
+    return whisper_decode_batch_internal(wctx, wstate, states.data(), decoders, tokens, n_tokens, n_past, n_batch, n_threads, logits_all);
+}
+
+// evaluate the decoder for a single sequence
+//
+//   - decoder:    the decoder that owns the self-attention KV cache
+//   - tokens:     text prompt
+//   - n_tokens:   number of tokens in the prompt
+//   - n_past:     number of past tokens to prefix the prompt with
+//   - logits_all: compute the logits for all tokens instead of only the last one
+//
+static bool whisper_decode_internal(
+        whisper_context & wctx,
+          whisper_state & wstate,
+        whisper_decoder & decoder,
+    const whisper_token * tokens,
+              const int   n_tokens,
+              const int   n_past,
+              const int   n_threads,
+             const bool   logits_all) {
+    whisper_decoder * decoders[1] = { &decoder };
+
+    return whisper_decode_batch_internal(wctx, wstate, decoders, tokens, n_tokens, &n_past, 1, n_threads, logits_all);
+}
+
 //  500 -> 00:05.000
 // 6000 -> 01:00.000
 static std::string to_timestamp(int64_t t, bool comma = false) {
@@ -2375,16 +3339,74 @@ static void fft(const std::vector<float> & in, std::vector<float> & out) {
     }
 }
 
+// float32 log10 approximation for positive normal inputs (cephes logf polynomial)
+// absolute error is about 1e-6 (float rounding), far less than the F16 precision of the encoder input
+// written without branches so that loops over it can be vectorized
+static inline float log10f_fast(float x) {
+    uint32_t bits;
+    memcpy(&bits, &x, sizeof(bits));
+
+    // x = m*2^e, m in [sqrt(0.5), sqrt(2))
+    int32_t e = (int32_t) (bits >> 23) - 127;
+    bits = (bits & 0x007fffff) | 0x3f800000;
+
+    float m;
+    memcpy(&m, &bits, sizeof(m));
+
+    const bool big = m > 1.41421356f;
+    m  = big ? 0.5f*m : m;
+    e += big ? 1 : 0;
+
+    const float f = m - 1.0f;
+    const float z = f*f;
+
+    float y = 7.0376836292e-2f;
+    y = y*f - 1.1514610310e-1f;
+    y = y*f + 1.1676998740e-1f;
+    y = y*f - 1.2420140846e-1f;
+    y = y*f + 1.4249322787e-1f;
+    y = y*f - 1.6668057665e-1f;
+    y = y*f + 2.0000714765e-1f;
+    y = y*f - 2.4999993993e-1f;
+    y = y*f + 3.3333331174e-1f;
+    y = y*f*z;
+
+    const float fe = (float) e;
+
+    y += -2.12194440e-4f*fe;
+    y += -0.5f*z;
+
+    const float ln = f + y + 0.693359375f*fe;
+
+    return ln*0.43429448190325182f; // log10(e)
+}
+
 static void log_mel_spectrogram_worker_thread(int ith, const std::vector<float> &hann, const float *samples,
                                               int n_samples, int fft_size, int fft_step, int n_threads,
-                                              const whisper_filters &filters, bool speed_up, whisper_mel &mel) {
+                                              const whisper_filters &filters, bool speed_up, whisper_mel &mel,
+                                              float &mmax) {
     std::vector<float> fft_in(fft_size, 0.0);
     std::vector<float> fft_out(2 * fft_size);
+    std::vector<float> mel_frame(mel.n_mel);
     int n_fft = 1 + (speed_up ? fft_size / 4 : fft_size / 2);
 
+    // partial maximum over the frames processed by this thread
+    float mmax_cur = -1e20f;
+
     for (int i = ith; i < mel.n_len; i += n_threads) {
         const int offset = i * fft_step;
 
+        // frame is entirely in the zero padding - the power spectrum is 0 in all bins
+        if (offset >= n_samples) {
+            for (int j = 0; j < mel.n_mel; j++) {
+                mel.data[j * mel.n_len + i] = -10.0f; // log10(1e-10)
+            }
+
+            mmax_cur = std::max(mmax_cur, -10.0f);
+
+            continue;
+        }
+
         // apply Hanning window
         for (int j = 0; j < fft_size; j++) {
             if (offset + j < n_samples) {
@@ -2413,28 +3435,55 @@ static void log_mel_spectrogram_worker_thread(int ith, const std::vector<float>
 
         // mel spectrogram
         for (int j = 0; j < mel.n_mel; j++) {
-            double sum = 0.0;
+            const float * filter = filters.data.data() + j*n_fft;
+
+            // independent partial sums so that the loop can be vectorized
+            float sum[8] = { 0.0f };
 
-            // unroll loop (suggested by GH user @lunixbochs)
             int k = 0;
-            for (k = 0; k < n_fft - 3; k += 4) {
-                sum +=
-                    fft_out[k + 0] * filters.data[j*n_fft + k + 0] +
-                    fft_out[k + 1] * filters.data[j*n_fft + k + 1] +
-                    fft_out[k + 2] * filters.data[j*n_fft + k + 2] +
-                    fft_out[k + 3] * filters.data[j*n_fft + k + 3];
+            for (k = 0; k + 8 <= n_fft; k += 8) {
+                for (int l = 0; l < 8; l++) {
+                    sum[l] += fft_out[k + l]*filter[k + l];
+                }
             }
 
             // handle n_fft remainder
             for (; k < n_fft; k++) {
-                sum += fft_out[k] * filters.data[j * n_fft + k];
+                sum[0] += fft_out[k]*filter[k];
             }
 
-            sum = log10(std::max(sum, 1e-10));
+            mel_frame[j] = std::max(((sum[0] + sum[1]) + (sum[2] + sum[3])) + ((sum[4] + sum[5]) + (sum[6] + sum[7])), 1e-10f);
+        }
+
+        for (int j = 0; j < mel.n_mel; j++) {
+            mel_frame[j] = log10f_fast(mel_frame[j]);
+        }
+
+        for (int j = 0; j < mel.n_mel; j++) {
+            mel.data[j * mel.n_len + i] = mel_frame[j];
 
-            mel.data[j * mel.n_len + i] = sum;
+            mmax_cur = std::max(mmax_cur, mel_frame[j]);
         }
     }
+
+    mmax = mmax_cur;
+}
+
+// clamp the log mel values to [mmax - 8, mmax] and normalize
+// each thread processes a contiguous range of the spectrogram
+static void log_mel_spectrogram_normalize_thread(int ith, int n_threads, float mmin, whisper_mel &mel) {
+    const int n = mel.n_mel*mel.n_len;
+
+    const int dn = (n + n_threads - 1)/n_threads;
+    const int i0 = std::min(n, ith*dn);
+    const int i1 = std::min(n, i0 + dn);
+
+    float * data = mel.data.data();
+
+    // branch-free so that the compiler can vectorize it
+    for (int i = i0; i < i1; i++) {
+        data[i] = (std::max(data[i], mmin) + 4.0f)*0.25f;
+    }
 }
 
 // ref: https://github.com/openai/whisper/blob/main/whisper/audio.py#L92-L124
@@ -2462,10 +3511,11 @@ static bool log_mel_spectrogram(
     mel.n_mel     = n_mel;
     mel.n_len     = n_samples/fft_step;
     mel.n_len_org = mel.n_len;
-
-    std::vector<float> samples_padded;
+    mel.id        = whisper_mel_new_id();
 
     // pad audio with at least one extra chunk of zeros
+    // the padding is virtual - the worker threads treat samples past n_samples as zeros,
+    // so there is no need to make a padded copy of the input
     {
         const int pad = (100*WHISPER_CHUNK_SIZE)/2;
 
@@ -2473,12 +3523,6 @@ static bool log_mel_spectrogram(
             mel.n_len = (mel.n_len/pad + 1)*pad;
         }
         mel.n_len += pad;
-
-        samples_padded.resize(mel.n_len*fft_step);
-        memcpy(samples_padded.data(), samples, n_samples*sizeof(float));
-        memset(samples_padded.data() + n_samples, 0, (mel.n_len*fft_step - n_samples)*sizeof(float));
-
-        samples = samples_padded.data();
     }
 
     mel.data.resize(mel.n_mel*mel.n_len);
@@ -2486,17 +3530,20 @@ static bool log_mel_spectrogram(
     //printf("%s: n_samples = %d, n_len = %d\n", __func__, n_samples, mel.n_len);
     //printf("%s: recording length: %f s\n", __func__, (float) n_samples/sample_rate);
 
+    // per-thread partial maxima of the log mel values
+    std::vector<float> mmax_thread(n_threads, -1e20f);
+
     {
         std::vector<std::thread> workers(n_threads - 1);
         for (int iw = 0; iw < n_threads - 1; ++iw) {
             workers[iw] = std::thread(
                     log_mel_spectrogram_worker_thread, iw + 1, std::cref(hann), samples,
                     n_samples, fft_size, fft_step, n_threads,
-                    std::cref(filters), speed_up, std::ref(mel));
+                    std::cref(filters), speed_up, std::ref(mel), std::ref(mmax_thread[iw + 1]));
         }
 
         // main thread
-        log_mel_spectrogram_worker_thread(0, hann, samples, n_samples, fft_size, fft_step, n_threads, filters, speed_up, mel);
+        log_mel_spectrogram_worker_thread(0, hann, samples, n_samples, fft_size, fft_step, n_threads, filters, speed_up, mel, mmax_thread[0]);
 
         for (int iw = 0; iw < n_threads - 1; ++iw) {
             workers[iw].join();
@@ -2504,22 +3551,23 @@ static bool log_mel_spectrogram(
     }
 
     // clamping and normalization
-    double mmax = -1e20;
-    for (int i = 0; i < mel.n_mel*mel.n_len; i++) {
-        if (mel.data[i] > mmax) {
-            mmax = mel.data[i];
-        }
-    }
-    //printf("%s: max = %f\n", __func__, mmax);
+    {
+        const float mmax = *std::max_element(mmax_thread.begin(), mmax_thread.end());
+        //printf("%s: max = %f\n", __func__, mmax);
 
-    mmax -= 8.0;
+        const float mmin = mmax - 8.0f;
 
-    for (int i = 0; i < mel.n_mel*mel.n_len; i++) {
-        if (mel.data[i] < mmax) {
-            mel.data[i] = mmax;
+        std::vector<std::thread> workers(n_threads - 1);
+        for (int iw = 0; iw < n_threads - 1; ++iw) {
+            workers[iw] = std::thread(log_mel_spectrogram_normalize_thread, iw + 1, n_threads, mmin, std::ref(mel));
         }
 
-        mel.data[i] = (mel.data[i] + 4.0)/4.0;
+        // main thread
+        log_mel_spectrogram_normalize_thread(0, n_threads, mmin, mel);
+
+        for (int iw = 0; iw < n_threads - 1; ++iw) {
+            workers[iw].join();
+        }
     }
 
     wstate.t_mel_us += ggml_time_us() - t_start_us;
@@ -2621,18 +3669,19 @@ struct whisper_state * whisper_init_state(whisper_context * ctx, const int verbo
 
     const size_t scale = ctx->model.hparams.ftype ? 1 : 2;
 
-    if (!kv_cache_init(ctx->model.hparams, scale * MEM_REQ_KV_SELF.at(ctx->model.type), state->decoders[0].kv_self, ctx->itype, ctx->model.hparams.n_text_ctx)) {
-        if (verbose) Rprintf("%s: kv_cache_init() failed for self-attention cache\n", __func__);
+    // a single block - whisper_full() sizes the self-attention cache for its decoders and it grows as needed
+    if (!kv_pool_init(ctx->model.hparams, state->kv_pool, ctx->itype, 1)) {
+        if (verbose) Rprintf("%s: kv_pool_init() failed for self-attention cache\n", __func__);
         delete state;
         return nullptr;
     }
 
     {
-        const size_t memory_size = ggml_nbytes(state->decoders[0].kv_self.k) + ggml_nbytes(state->decoders[0].kv_self.v);
+        const size_t memory_size = ggml_nbytes(state->kv_pool.cache.k) + ggml_nbytes(state->kv_pool.cache.v);
       if (verbose) Rprintf("%s: kv self size  = %7.2f MB\n", __func__, memory_size / 1024.0 / 1024.0);
     }
 
-    if (!kv_cache_init(ctx->model.hparams, scale * MEM_REQ_KV_CROSS.at(ctx->model.type), state->kv_cross, ctx->itype, ctx->model.hparams.n_audio_ctx)) {
+    if (!kv_cache_init(ctx->model.hparams, scale * MEM_REQ_KV_CROSS.at(ctx->model.type), state->kv_cross, ctx->ktype, kv_cross_n_pad(ctx->ktype, ctx->model.hparams.n_audio_ctx))) {
       if (verbose) Rprintf("%s: kv_cache_init() failed for cross-attention cache\n", __func__);
         delete state;
         return nullptr;
@@ -2660,7 +3709,9 @@ struct whisper_state * whisper_init_state(whisper_context * ctx, const int verbo
     }
 #endif
 
-    state->logits.reserve(ctx->vocab.n_vocab * ctx->model.hparams.n_text_ctx);
+    // whisper_full() computes the logits only for the last token of each decoder (grows with the batch,
+    // and with the number of tokens passed to whisper_decode())
+    state->logits.reserve(ctx->vocab.n_vocab);
 
     state->logits_id.reserve(ctx->model.hparams.n_vocab);
 
@@ -2824,10 +3875,7 @@ void whisper_free_state(struct whisper_state * state)
 {
     if (state) {
         kv_cache_free(state->kv_cross);
-
-        for (int i = 0; i < WHISPER_MAX_DECODERS; ++i) {
-            kv_cache_free(state->decoders[i].kv_self);
-        }
+        kv_cache_free(state->kv_pool.cache);
 
 #ifdef WHISPER_USE_COREML
         if (state->ctx_coreml != nullptr) {
@@ -2836,6 +3884,9 @@ void whisper_free_state(struct whisper_state * state)
         }
 #endif
 
+        whisper_free_state(state->state_ahead);
+        whisper_free_state(state->state_draft);
+
         delete state;
     }
 }
@@ -2855,22 +3906,99 @@ void whisper_free(struct whisper_context * ctx) {
     }
 }
 
-int whisper_pcm_to_mel_with_state(struct whisper_context * ctx, struct whisper_state * state, const float * samples, int n_samples, int n_threads) {
-    if (!log_mel_spectrogram(*state, samples, n_samples, WHISPER_SAMPLE_RATE, WHISPER_N_FFT, WHISPER_HOP_LENGTH, WHISPER_N_MEL, n_threads, ctx->model.filters, false, state->mel)) {
-        Rprintf("%s: failed to compute mel spectrogram\n", __func__);
-        return -1;
+// fast non-cryptographic 64-bit hash of the raw PCM samples
+static uint64_t whisper_hash_samples(const float * samples, int n_samples) {
+    const uint8_t * data = (const uint8_t *) samples;
+    const size_t    n    = (size_t) n_samples*sizeof(float);
+
+    uint64_t h = 0x9e3779b97f4a7c15ull ^ n;
+
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        uint64_t w;
+        memcpy(&w, data + i, 8);
+        w *= 0xff51afd7ed558ccdull;
+        w ^= w >> 32;
+        h  = (h ^ w)*0xc4ceb9fe1a85ec53ull;
+        h ^= h >> 29;
+    }
+    for (; i < n; i++) {
+        h = (h ^ data[i])*0x100000001b3ull;
     }
 
-    return 0;
-}
-
-int whisper_pcm_to_mel(struct whisper_context * ctx, const float * samples, int n_samples, int n_threads) {
-    return whisper_pcm_to_mel_with_state(ctx, ctx->state, samples, n_samples, n_threads);
+    return h;
 }
 
-// same as whisper_pcm_to_mel, but applies a Phase Vocoder to speed up the audio x2
-int whisper_pcm_to_mel_phase_vocoder_with_state(struct whisper_context * ctx, struct whisper_state * state, const float * samples, int n_samples, int n_threads) {
-    if (!log_mel_spectrogram(*state, samples, n_samples, WHISPER_SAMPLE_RATE, 2 * WHISPER_N_FFT, 2 * WHISPER_HOP_LENGTH, WHISPER_N_MEL, n_threads, ctx->model.filters, true, state->mel)) {
+// compute the log mel spectrogram into state->mel, reusing a cached result for the same audio if possible
+static bool whisper_pcm_to_mel_internal(
+        whisper_context & ctx,
+          whisper_state & state,
+            const float * samples,
+              const int   n_samples,
+              const int   fft_size,
+              const int   fft_step,
+              const int   n_threads,
+             const bool   speed_up) {
+    auto & cache = state.cache;
+
+    state.mel_key = {};
+
+    if (cache.n_mel_max <= 0 && cache.n_encode_max <= 0) {
+        return log_mel_spectrogram(state, samples, n_samples, WHISPER_SAMPLE_RATE, fft_size, fft_step, WHISPER_N_MEL, n_threads, ctx.model.filters, speed_up, state.mel);
+    }
+
+    whisper_mel_key key;
+    key.valid     = true;
+    key.hash      = whisper_hash_samples(samples, n_samples);
+    key.n_samples = n_samples;
+    key.fft_size  = fft_size;
+    key.fft_step  = fft_step;
+    key.speed_up  = speed_up;
+
+    for (auto it = cache.mels.begin(); it != cache.mels.end(); ++it) {
+        if (it->key == key) {
+            state.mel     = it->mel;
+            state.mel_key = key;
+
+            cache.mels.splice(cache.mels.begin(), cache.mels, it);
+            cache.n_hit_mel++;
+
+            return true;
+        }
+    }
+
+    if (!log_mel_spectrogram(state, samples, n_samples, WHISPER_SAMPLE_RATE, fft_size, fft_step, WHISPER_N_MEL, n_threads, ctx.model.filters, speed_up, state.mel)) {
+        return false;
+    }
+
+    state.mel_key = key;
+
+    if (cache.n_mel_max > 0) {
+        if ((int) cache.mels.size() >= cache.n_mel_max) {
+            cache.mels.pop_back();
+        }
+        cache.mels.push_front({ key, state.mel });
+    }
+
+    return true;
+}
+
+int whisper_pcm_to_mel_with_state(struct whisper_context * ctx, struct whisper_state * state, const float * samples, int n_samples, int n_threads) {
+    if (!whisper_pcm_to_mel_internal(*ctx, *state, samples, n_samples, WHISPER_N_FFT, WHISPER_HOP_LENGTH, n_threads, false)) {
+        Rprintf("%s: failed to compute mel spectrogram\n", __func__);
+        return -1;
+    }
+
+    return 0;
+}
+
+int whisper_pcm_to_mel(struct whisper_context * ctx, const float * samples, int n_samples, int n_threads) {
+    return whisper_pcm_to_mel_with_state(ctx, ctx->state, samples, n_samples, n_threads);
+}
+
+// same as whisper_pcm_to_mel, but applies a Phase Vocoder to speed up the audio x2
+int whisper_pcm_to_mel_phase_vocoder_with_state(struct whisper_context * ctx, struct whisper_state * state, const float * samples, int n_samples, int n_threads) {
+    if (!whisper_pcm_to_mel_internal(*ctx, *state, samples, n_samples, 2 * WHISPER_N_FFT, 2 * WHISPER_HOP_LENGTH, n_threads, true)) {
         Rprintf("%s: failed to compute mel spectrogram\n", __func__);
         return -1;
     }
@@ -2894,9 +4022,13 @@ int whisper_set_mel_with_state(
         return -1;
     }
 
+    // the origin of a user-provided spectrogram is unknown - do not use the encoder cache for it
+    state->mel_key = {};
+
     state->mel.n_len     = n_len;
     state->mel.n_len_org = n_len;
     state->mel.n_mel     = n_mel;
+    state->mel.id        = whisper_mel_new_id();
 
     state->mel.data.resize(n_len*n_mel);
     memcpy(state->mel.data.data(), data, n_len*n_mel*sizeof(float));
@@ -2912,6 +4044,59 @@ int whisper_set_mel(
     return whisper_set_mel_with_state(ctx, ctx->state, data, n_len, n_mel);
 }
 
+void whisper_set_cache_with_state(struct whisper_context * /*ctx*/, struct whisper_state * state, int n_mel, int n_encode) {
+    auto & cache = state->cache;
+
+    cache.n_mel_max    = std::max(0, n_mel);
+    cache.n_encode_max = std::max(0, n_encode);
+
+    while ((int) cache.mels.size() > cache.n_mel_max) {
+        cache.mels.pop_back();
+    }
+    while ((int) cache.encodes.size() > cache.n_encode_max) {
+        cache.encodes.pop_back();
+    }
+}
+
+void whisper_set_cache(struct whisper_context * ctx, int n_mel, int n_encode) {
+    whisper_set_cache_with_state(ctx, ctx->state, n_mel, n_encode);
+}
+
+int whisper_set_kv_cross_q8(struct whisper_context * ctx, bool enable) {
+    const ggml_type ktype = enable ? GGML_TYPE_Q8_0 : ctx->itype;
+
+    if (ktype == ctx->ktype) {
+        return 0;
+    }
+
+    ctx->ktype = ktype;
+
+    if (ctx->state == nullptr) {
+        return 0;
+    }
+
+    auto * state = ctx->state;
+
+    const size_t scale = ctx->model.hparams.ftype ? 1 : 2;
+
+    kv_cache_free(state->kv_cross);
+
+    if (!kv_cache_init(ctx->model.hparams, scale * MEM_REQ_KV_CROSS.at(ctx->model.type), state->kv_cross, ktype, kv_cross_n_pad(ktype, ctx->model.hparams.n_audio_ctx))) {
+        Rprintf("%s: kv_cache_init() failed for cross-attention cache\n", __func__);
+        return -1;
+    }
+
+    // the encoder output is gone and the cached windows have the old type
+    state->kv_cross_src = {};
+    state->cache.encodes.clear();
+
+    // the helper state of whisper_full() is created again with the new type when needed
+    whisper_free_state(state->state_ahead);
+    state->state_ahead = nullptr;
+
+    return 0;
+}
+
 int whisper_encode_with_state(struct whisper_context * ctx, struct whisper_state * state, int offset, int n_threads) {
     if (!whisper_encode_internal(*ctx, *state, offset, n_threads)) {
         Rprintf("%s: failed to eval\n", __func__);
@@ -2930,10 +4115,188 @@ int whisper_encode(struct whisper_context * ctx, int offset, int n_threads) {
     return 0;
 }
 
+int whisper_encode_batch_with_state(struct whisper_context * ctx, struct whisper_state * state, const int * offsets, int n_offsets, int n_threads) {
+    if (n_offsets <= 0) {
+        Rprintf("%s: no windows to encode\n", __func__);
+        return -1;
+    }
+
+    if (!whisper_encode_batch_internal(*ctx, *state, offsets, n_offsets, n_threads, false, nullptr, -1)) {
+        Rprintf("%s: failed to eval\n", __func__);
+        return -1;
+    }
+
+    return 0;
+}
+
+int whisper_encode_batch(struct whisper_context * ctx, const int * offsets, int n_offsets, int n_threads) {
+    return whisper_encode_batch_with_state(ctx, ctx->state, offsets, n_offsets, n_threads);
+}
+
+int whisper_encode_save_with_state(struct whisper_context * ctx, struct whisper_state * state, const char * path) {
+    const auto & hparams = ctx->model.hparams;
+    const auto & src     = state->kv_cross_src;
+    const auto & kv      = state->kv_cross;
+
+    if (src.mel_offset < 0) {
+        Rprintf("%s: no encoder output to save - call whisper_encode() first\n", __func__);
+        return -1;
+    }
+
+    whisper_encode_file_header header = {};
+
+    header.magic         = WHISPER_ENCODE_FILE_MAGIC;
+    header.version       = WHISPER_ENCODE_FILE_VERSION;
+    header.n_audio_state = hparams.n_audio_state;
+    header.n_text_layer  = hparams.n_text_layer;
+    header.type          = kv.k->type;
+    header.n_ctx         = src.n_ctx;
+    header.mel_offset    = src.mel_offset;
+    header.mel_n_len     = src.n_len;
+    header.key_hash      = src.key.hash;
+    header.key_valid     = src.key.valid;
+    header.key_n_samples = src.key.n_samples;
+    header.key_fft_size  = src.key.fft_size;
+    header.key_fft_step  = src.key.fft_step;
+    header.key_speed_up  = src.key.speed_up;
+    header.stem_reuse    = src.stem_reuse;
+    header.nbytes        = whisper_cache_encode_nbytes(kv, hparams.n_text_layer, src.n_ctx, hparams.n_audio_state);
+
+    const size_t nbytes_aligned = ((header.nbytes + WHISPER_ENCODE_FILE_ALIGN - 1)/WHISPER_ENCODE_FILE_ALIGN)*WHISPER_ENCODE_FILE_ALIGN;
+
+    std::ofstream fout(path, std::ios::binary);
+    if (!fout) {
+        Rprintf("%s: failed to open '%s' for writing\n", __func__, path);
+        return -2;
+    }
+
+    const std::vector<char> zeros(WHISPER_ENCODE_FILE_ALIGN, 0);
+
+    fout.write((const char *) &header, sizeof(header));
+    fout.write(zeros.data(), WHISPER_ENCODE_FILE_ALIGN - sizeof(header));
+    fout.write((const char *) kv.k->data, header.nbytes);
+    fout.write(zeros.data(), nbytes_aligned - header.nbytes);
+    fout.write((const char *) kv.v->data, header.nbytes);
+
+    if (!fout) {
+        Rprintf("%s: failed to write '%s'\n", __func__, path);
+        return -3;
+    }
+
+    return 0;
+}
+
+int whisper_encode_save(struct whisper_context * ctx, const char * path) {
+    return whisper_encode_save_with_state(ctx, ctx->state, path);
+}
+
+int whisper_encode_load_with_state(struct whisper_context * ctx, struct whisper_state * state, const char * path) {
+    const auto & hparams = ctx->model.hparams;
+    auto & kv = state->kv_cross;
+
+    std::ifstream fin(path, std::ios::binary);
+    if (!fin) {
+        Rprintf("%s: failed to open '%s'\n", __func__, path);
+        return -1;
+    }
+
+    whisper_encode_file_header header = {};
+
+    fin.read((char *) &header, sizeof(header));
+
+    if (!fin || header.magic != WHISPER_ENCODE_FILE_MAGIC || header.version != WHISPER_ENCODE_FILE_VERSION) {
+        Rprintf("%s: '%s' is not a saved encoder output\n", __func__, path);
+        return -2;
+    }
+
+    if (header.n_audio_state != hparams.n_audio_state ||
+        header.n_text_layer  != hparams.n_text_layer  ||
+        header.type          != kv.k->type            ||
+        header.n_ctx <= 0 || header.n_ctx > hparams.n_audio_ctx ||
+        header.nbytes != whisper_cache_encode_nbytes(kv, hparams.n_text_layer, header.n_ctx, hparams.n_audio_state)) {
+        Rprintf("%s: '%s' was saved with a different model\n", __func__, path);
+        return -3;
+    }
+
+    const size_t nbytes_aligned = ((header.nbytes + WHISPER_ENCODE_FILE_ALIGN - 1)/WHISPER_ENCODE_FILE_ALIGN)*WHISPER_ENCODE_FILE_ALIGN;
+
+    fin.seekg(WHISPER_ENCODE_FILE_ALIGN);
+    fin.read((char *) kv.k->data, header.nbytes);
+    fin.seekg(WHISPER_ENCODE_FILE_ALIGN + nbytes_aligned);
+    fin.read((char *) kv.v->data, header.nbytes);
+
+    if (!fin) {
+        Rprintf("%s: failed to read '%s'\n", __func__, path);
+        state->kv_cross_src = {};
+        return -4;
+    }
+
+    auto & src = state->kv_cross_src;
+
+    src.key.valid     = header.key_valid != 0;
+    src.key.hash      = header.key_hash;
+    src.key.n_samples = header.key_n_samples;
+    src.key.fft_size  = header.key_fft_size;
+    src.key.fft_step  = header.key_fft_step;
+    src.key.speed_up  = header.key_speed_up != 0;
+    src.mel_offset    = header.mel_offset;
+    src.n_ctx         = header.n_ctx;
+    src.n_len         = header.mel_n_len;
+    src.stem_reuse    = header.stem_reuse != 0;
+
+    // the decoder attends to the saved number of positions
+    state->exp_n_audio_ctx = header.n_ctx < hparams.n_audio_ctx ? header.n_ctx : 0;
+
+    // let whisper_full() on the same audio pick it up instead of running the encoder
+    if (state->cache.n_encode_max > 0 && src.key.valid) {
+        auto & entry = whisper_cache_new_encode(*state, src.mel_offset, src.n_ctx, header.nbytes);
+
+        entry.key        = src.key;
+        entry.stem_reuse = src.stem_reuse;
+
+        memcpy(entry.k.data(), kv.k->data, header.nbytes);
+        memcpy(entry.v.data(), kv.v->data, header.nbytes);
+    }
+
+    return 0;
+}
+
+int whisper_encode_load(struct whisper_context * ctx, const char * path) {
+    return whisper_encode_load_with_state(ctx, ctx->state, path);
+}
+
+int whisper_encode_features_with_state(struct whisper_context * ctx, struct whisper_state * state, int offset, int layer, int audio_ctx, float * out, int n_threads) {
+    if (audio_ctx < 0 || audio_ctx > whisper_n_audio_ctx(ctx)) {
+        Rprintf("%s: invalid audio_ctx %d\n", __func__, audio_ctx);
+        return -1;
+    }
+
+    const int exp_n_audio_ctx = state->exp_n_audio_ctx;
+
+    state->exp_n_audio_ctx = audio_ctx;
+
+    state->features = nullptr;
+
+    const bool ok = whisper_encode_batch_internal(*ctx, *state, &offset, 1, n_threads, true, out, layer);
+
+    state->exp_n_audio_ctx = exp_n_audio_ctx;
+
+    if (!ok) {
+        Rprintf("%s: failed to eval\n", __func__);
+        return -1;
+    }
+
+    return audio_ctx > 0 ? audio_ctx : whisper_n_audio_ctx(ctx);
+}
+
+int whisper_encode_features(struct whisper_context * ctx, int offset, int layer, int audio_ctx, float * out, int n_threads) {
+    return whisper_encode_features_with_state(ctx, ctx->state, offset, layer, audio_ctx, out, n_threads);
+}
+
 int whisper_decode_with_state(struct whisper_context * ctx, struct whisper_state * state, const whisper_token * tokens, int n_tokens, int n_past, int n_threads) {
     const int selected_decoder_id = 0;
 
-    if (!whisper_decode_internal(*ctx, *state, state->decoders[selected_decoder_id], tokens, n_tokens, n_past, n_threads)) {
+    if (!whisper_decode_internal(*ctx, *state, state->decoders[selected_decoder_id], tokens, n_tokens, n_past, n_threads, true)) {
         Rprintf("%s: failed to eval\n", __func__);
         return 1;
     }
@@ -2951,7 +4314,7 @@ int whisper_decode(struct whisper_context * ctx, const whisper_token * tokens, i
     }
 
 
-    if (!whisper_decode_internal(*ctx, *ctx->state, ctx->state->decoders[selected_decoder_id], tokens, n_tokens, n_past, n_threads)) {
+    if (!whisper_decode_internal(*ctx, *ctx->state, ctx->state->decoders[selected_decoder_id], tokens, n_tokens, n_past, n_threads, true)) {
         Rprintf("%s: failed to eval\n", __func__);
         return 1;
     }
@@ -3189,6 +4552,14 @@ float * whisper_get_logits_from_state(struct whisper_state * state) {
     return state->logits.data();
 }
 
+const float * whisper_get_features(struct whisper_context * ctx) {
+    return ctx->state->features;
+}
+
+const float * whisper_get_features_from_state(struct whisper_state * state) {
+    return state->features;
+}
+
 const char * whisper_token_to_str(struct whisper_context * ctx, whisper_token token) {
     return ctx->vocab.id_to_token.at(token).c_str();
 }
@@ -3314,6 +4685,13 @@ struct whisper_full_params whisper_full_default_params(enum whisper_sampling_str
 
         /*.speed_up         =*/ false,
         /*.audio_ctx        =*/ 0,
+        /*.n_threads_ahead  =*/ 0,
+        /*.stem_reuse       =*/ false,
+
+        /*.draft_ctx        =*/ nullptr,
+        /*.draft_n_tokens   =*/ 4,
+
+        /*.scheduler        =*/ nullptr,
 
         /*.initial_prompt   =*/ nullptr,
         /*.prompt_tokens    =*/ nullptr,
@@ -3325,6 +4703,9 @@ struct whisper_full_params whisper_full_default_params(enum whisper_sampling_str
         /*.suppress_blank   =*/ true,
         /*.suppress_non_speech_tokens =*/ false,
 
+        /*.allowed_tokens   =*/ nullptr,
+        /*.n_allowed_tokens =*/ 0,
+
         /*.temperature      =*/  0.0f,
         /*.max_initial_ts   =*/  1.0f,
         /*.length_penalty   =*/ -1.0f,
@@ -3482,11 +4863,14 @@ static const std::vector<std::string> non_speech_tokens = {
 // process the logits for the selected decoder
 // - applies logit filters
 // - computes logprobs and probs
+//
+// i_batch is the row of state.logits that holds the logits of the decoder (see whisper_decode_batch_internal)
 static void whisper_process_logits(
               struct whisper_context & ctx,
                struct whisper_state  & state,
     const struct whisper_full_params   params,
               struct whisper_decoder & decoder,
+                                 int   i_batch,
                                float   temperature) {
     const auto & vocab      = ctx.vocab;
     const auto & tokens_cur = decoder.sequence.tokens;
@@ -3502,8 +4886,10 @@ static void whisper_process_logits(
     auto & logits   = decoder.logits;
     auto & logprobs = decoder.logprobs;
     {
+        WHISPER_ASSERT((int) state.logits.size() >= (i_batch + 1)*n_logits);
+
         logits.resize(n_logits);
-        memcpy(logits.data(), state.logits.data() + (state.logits.size() - n_logits), n_logits*sizeof(float));
+        memcpy(logits.data(), state.logits.data() + i_batch*n_logits, n_logits*sizeof(float));
 
         if (temperature > 0.0f) {
             for (int i = 0; i < n_logits; i++) {
@@ -3700,186 +5086,622 @@ static void whisper_process_logits(
 #endif
 }
 
-static whisper_token_data whisper_sample_token(
-            whisper_context & ctx,
-              whisper_state & state,
-      const whisper_decoder & decoder,
-                       bool   best) {
-    whisper_token_data result = {
-        0, 0, 0.0f, 0.0f, 0.0f, 0.0f, -1, -1, 0.0f,
-    };
+static whisper_token_data whisper_sample_token(
+            whisper_context & ctx,
+              whisper_state & state,
+      const whisper_decoder & decoder,
+                       bool   best) {
+    whisper_token_data result = {
+        0, 0, 0.0f, 0.0f, 0.0f, 0.0f, -1, -1, 0.0f,
+    };
+
+    const auto & vocab = ctx.vocab;
+
+    const auto & probs    = decoder.probs;
+    const auto & logprobs = decoder.logprobs;
+
+    const int n_logits = vocab.n_vocab;
+
+    {
+        double sum_ts = 0.0;
+        double max_ts = 0.0;
+
+        for (int i = vocab.token_beg; i < n_logits; i++) {
+            if (probs[i] == -INFINITY) {
+                continue;
+            }
+
+            sum_ts += probs[i];
+            if (max_ts < probs[i]) {
+                max_ts = probs[i];
+                result.tid = i;
+            }
+        }
+
+        result.pt    = max_ts/(sum_ts + 1e-10);
+        result.ptsum = sum_ts;
+    }
+
+    if (best) {
+        for (int i = 0; i < n_logits; ++i) {
+            if (result.p < probs[i]) {
+                result.id   = i;
+                result.p    = probs[i];
+                result.plog = logprobs[i];
+            }
+        }
+    } else {
+        std::discrete_distribution<> dist(probs.begin(), probs.end());
+
+        result.id   = dist(state.rng);
+        result.p    = probs[result.id];
+        result.plog = logprobs[result.id];
+    }
+
+    if (result.id >= vocab.token_beg) {
+        result.tid = result.id;
+        result.pt  = result.p;
+    }
+
+    state.n_sample++;
+
+    return result;
+}
+
+static std::vector<whisper_token_data> whisper_sample_token_topk(
+            whisper_context & ctx,
+              whisper_state & state,
+      const whisper_decoder & decoder,
+                        int   k) {
+    const auto & vocab = ctx.vocab;
+
+    const auto & probs    = decoder.probs;
+    const auto & logits   = decoder.logits;
+    const auto & logprobs = decoder.logprobs;
+
+    const int n_logits = vocab.n_vocab;
+
+    auto & logits_id = state.logits_id;
+
+    logits_id.clear();
+    for (int i = 0; i < n_logits; ++i) {
+        logits_id.push_back({ logits[i], i });
+    }
+
+    std::partial_sort(
+            logits_id.begin(),
+            logits_id.begin() + k, logits_id.end(),
+            [](const std::pair<double, whisper_token> & a, const std::pair<double, whisper_token> & b) {
+                return a.first > b.first;
+            });
+
+    std::vector<whisper_token_data> result;
+    result.reserve(k);
+
+    whisper_token tid = vocab.token_beg;
+
+    float pt    = 0.0;
+    float ptsum = 0.0;
+
+    {
+        double sum_ts = 0.0;
+        double max_ts = 0.0;
+
+        for (int i = vocab.token_beg; i < n_logits; i++) {
+            if (probs[i] == -INFINITY) {
+                continue;
+            }
+
+            sum_ts += probs[i];
+            if (max_ts < probs[i]) {
+                max_ts = probs[i];
+                tid = i;
+            }
+        }
+
+        pt    = max_ts/(sum_ts + 1e-10);
+        ptsum = sum_ts;
+    }
+
+    for (int i = 0; i < k; ++i) {
+        const auto id = logits_id[i].second;
+
+        result.push_back({ id, tid, probs[id], logprobs[id], pt, ptsum, -1, -1, 0.0f, });
+
+        if (result[i].id >= vocab.token_beg) {
+            result[i].tid = result[i].id;
+            result[i].pt  = result[i].p;
+        }
+    }
+
+    state.n_sample++;
+
+    return result;
+}
+
+// ref: https://github.com/openai/whisper/blob/0b1ba3d46ebf7fe6f953acfd8cad62a4f851b49f/whisper/decoding.py#L178-L192
+static void whisper_sequence_score(
+        const struct whisper_full_params & params,
+                        whisper_sequence & sequence) {
+    if (sequence.result_len == 0) {
+        return;
+    }
+
+    double result = 0.0f;
+
+    for (int i = 0; i < sequence.result_len; ++i) {
+        result += sequence.tokens[i].plog;
+    }
+
+    sequence.sum_logprobs = result;
+    sequence.avg_logprobs = result/sequence.result_len;
+
+    double penalty = sequence.result_len;
+
+    if (params.length_penalty > 0.0f) {
+        penalty = pow((5.0 + penalty)/6.0, params.length_penalty);
+    }
+
+    sequence.score = result/penalty;
+
+    // compute the entropy of the sequence of the last 32 tokens
+    {
+        const int n = 32;
+
+        int cnt = 0;
+        double entropy = 0.0f;
+
+        std::map<whisper_token, int> token_counts;
+        for (int i = std::max(0, sequence.result_len - n); i < sequence.result_len; ++i) {
+            token_counts[sequence.tokens[i].id]++;
+            cnt++;
+        }
+
+        for (const auto & kv : token_counts) {
+            const auto p = kv.second/(double)cnt;
+            entropy -= p*log(p);
+
+            //WHISPER_PRINT_DEBUG("entropy: %d %f %f, count %d\n", kv.first, p, log(p), kv.second);
+        }
+
+        sequence.entropy = entropy;
+    }
+}
+
+// [EXPERIMENTAL] encode the window after the one being decoded on a separate group of threads
+// the decoder usually moves on to its last timestamp rather than a full window ahead, so the speculative result
+// is only used when the next seek turns out to be exactly where it was started
+struct whisper_encode_ahead {
+    whisper_context & ctx;
+    whisper_state   & state;
+
+    std::thread worker;
+
+    int  seek = -1; // window being encoded ahead
+    bool ok   = false;
+
+    whisper_encode_ahead(whisper_context & ctx, whisper_state & state) : ctx(ctx), state(state) {}
+
+    ~whisper_encode_ahead() {
+        join();
+    }
+
+    // start encoding the window at seek_next into state.state_ahead
+    // the spectrogram is lent to the helper state until join() - nothing reads it while the current window is decoded
+    bool start(int seek_next, int n_threads) {
+        if (state.state_ahead == nullptr) {
+            state.state_ahead = whisper_init_state(&ctx, 0);
+            if (state.state_ahead == nullptr) {
+                return false;
+            }
+        }
+
+        auto & sa = *state.state_ahead;
+
+        std::swap(sa.mel, state.mel);
+        sa.exp_n_audio_ctx = state.exp_n_audio_ctx;
+        sa.exp_stem_reuse  = state.exp_stem_reuse;
+
+        seek = seek_next;
+        ok   = false;
+
+        worker = std::thread([this, &sa, n_threads]() {
+            ok = whisper_encode_internal(ctx, sa, seek, n_threads);
+        });
+
+        return true;
+    }
+
+    void join() {
+        if (worker.joinable()) {
+            worker.join();
+            std::swap(state.state_ahead->mel, state.mel);
+        }
+    }
+
+    // wait for the encoder and, if it computed the window at seek_cur with the current audio context,
+    // move its output into the cross-attention KV cache of the state
+    bool take(int seek_cur) {
+        if (!worker.joinable()) {
+            return false;
+        }
+
+        join();
+
+        auto & sa = *state.state_ahead;
+
+        if (!ok || seek != seek_cur || sa.exp_n_audio_ctx != state.exp_n_audio_ctx ||
+            sa.kv_cross.k->type != state.kv_cross.k->type) {
+            return false;
+        }
+
+        std::swap(state.kv_cross, sa.kv_cross);
+
+        state.n_encode++;
+
+        const auto & hparams = ctx.model.hparams;
+        const int n_ctx = state.exp_n_audio_ctx > 0 ? state.exp_n_audio_ctx : hparams.n_audio_ctx;
+
+        auto & src = state.kv_cross_src;
+
+        src.key        = state.mel_key;
+        src.mel_offset = seek;
+        src.n_ctx      = n_ctx;
+        src.n_len      = state.mel.n_len_org;
+        src.stem_reuse = state.exp_stem_reuse;
+
+        whisper_cache_put_encode(state, seek, n_ctx, hparams.n_text_layer, hparams.n_audio_state);
+
+        return true;
+    }
+};
+
+// [EXPERIMENTAL] speculative decoding with a smaller draft model (see whisper_full_params.draft_ctx)
+// the draft model proposes the next tokens greedily and the model evaluates all of them in a single pass,
+// keeping the logits of every position - as long as the model picks the proposed tokens, their logits are
+// already known and no further pass is needed
+// the draft model runs in its own state, with its own encoder output for the current window
+struct whisper_speculative {
+    whisper_context & ctx;
+    whisper_state   & state;
+
+    whisper_context * ctx_draft = nullptr;
+
+    int n_draft = 0;
+
+    int seek      = -1; // window encoded by the draft model
+    int n_ctx_enc = 0;  // audio context it was encoded with
+
+    std::vector<whisper_token> fed;    // tokens in the self-attention KV cache of the draft model
+    std::vector<whisper_token> stream; // prompt + tokens of the sequence
+    std::vector<whisper_token> batch;  // tokens evaluated by the last pass of the model (the last sampled token + the draft)
+
+    int i_batch = 0; // position in batch of the last sampled token
+
+    whisper_speculative(whisper_context & ctx, whisper_state & state, const whisper_full_params & params) : ctx(ctx), state(state) {
+        // the beam search never decodes with a single decoder at temperature 0
+        if (params.draft_ctx == nullptr || params.draft_n_tokens <= 0 || params.strategy != WHISPER_SAMPLING_GREEDY) {
+            return;
+        }
+
+        const auto & hparams       = ctx.model.hparams;
+        const auto & hparams_draft = params.draft_ctx->model.hparams;
+
+        if (hparams_draft.n_vocab     != hparams.n_vocab     ||
+            hparams_draft.n_mels      != hparams.n_mels      ||
+            hparams_draft.n_audio_ctx != hparams.n_audio_ctx ||
+            hparams_draft.n_text_ctx  != hparams.n_text_ctx) {
+            Rprintf("%s: the draft model does not match the model - speculative decoding is disabled\n", __func__);
+            return;
+        }
+
+        if (state.state_draft == nullptr || state.ctx_draft != params.draft_ctx) {
+            whisper_free_state(state.state_draft);
+
+            state.ctx_draft   = params.draft_ctx;
+            state.state_draft = whisper_init_state(params.draft_ctx, 0);
+            if (state.state_draft == nullptr) {
+                return;
+            }
+        }
+
+        // the draft model proposes only tokens that the model can pick
+        state.state_draft->exp_vocab_allowed = state.exp_vocab_allowed;
+
+        ctx_draft = params.draft_ctx;
+        n_draft   = params.draft_n_tokens;
+    }
+
+    bool enabled() const {
+        return ctx_draft != nullptr;
+    }
+
+    // start a new sequence - the logits of the last pass belong to the previous one
+    void reset() {
+        batch.clear();
+        i_batch = 0;
+    }
+
+    // encode the window at seek_cur with the draft model, unless it has already been encoded
+    // the spectrogram is lent to the draft state - call it before the next window is started ahead,
+    // which borrows the spectrogram until the current window is decoded (see whisper_encode_ahead)
+    bool encode(int seek_cur, int n_threads) {
+        auto & sd = *state.state_draft;
+
+        if (seek == seek_cur && n_ctx_enc == state.exp_n_audio_ctx) {
+            return true;
+        }
+
+        fed.clear();
+
+        std::swap(sd.mel, state.mel);
+        sd.exp_n_audio_ctx = state.exp_n_audio_ctx;
+
+        const bool ok = whisper_encode_internal(*ctx_draft, sd, seek_cur, n_threads);
+
+        std::swap(sd.mel, state.mel);
+
+        seek      = ok ? seek_cur : -1;
+        n_ctx_enc = state.exp_n_audio_ctx;
+
+        return ok;
+    }
+
+    // batch = the last sampled token of the decoder + up to n_draft tokens proposed by the draft model
+    bool propose(const whisper_full_params & params, const whisper_decoder & decoder, const std::vector<whisper_token> & prompt, int seek_cur) {
+        const auto & tokens = decoder.sequence.tokens;
+
+        batch.assign(1, tokens.back().id);
+
+        // room in the self-attention KV cache of the model
+        const int n = std::min(n_draft, ctx.model.hparams.n_text_ctx - decoder.kv_self.n - 1);
+        if (n <= 0) {
+            return true;
+        }
+
+        // the window has not been encoded with the draft model - evaluate the sampled token alone
+        if (seek != seek_cur || n_ctx_enc != state.exp_n_audio_ctx) {
+            return true;
+        }
+
+        auto & sd = *state.state_draft;
+        auto & dd = sd.decoders[0];
+
+        stream = prompt;
+        for (const auto & token : tokens) {
+            stream.push_back(token.id);
+        }
+
+        // keep the part of the KV cache of the draft model that holds the same tokens
+        // (at least one token is evaluated, for its logits)
+        size_t n_keep = 0;
+        while (n_keep < fed.size() && n_keep + 1 < stream.size() && fed[n_keep] == stream[n_keep]) {
+            ++n_keep;
+        }
+
+        fed.resize(n_keep);
 
-    const auto & vocab = ctx.vocab;
+        // the logit filters of the draft model see the same sequence
+        dd.sequence   = decoder.sequence;
+        dd.has_ts     = decoder.has_ts;
+        dd.seek_delta = decoder.seek_delta;
 
-    const auto & probs    = decoder.probs;
-    const auto & logprobs = decoder.logprobs;
+        for (int i = 0; i < n; ++i) {
+            const int n_past = fed.size();
 
-    const int n_logits = vocab.n_vocab;
+            if (!whisper_decode_internal(*ctx_draft, sd, dd, stream.data() + n_past, stream.size() - n_past, n_past, params.n_threads, false)) {
+                return false;
+            }
 
-    {
-        double sum_ts = 0.0;
-        double max_ts = 0.0;
+            fed.insert(fed.end(), stream.begin() + n_past, stream.end());
+            dd.kv_self.n = fed.size();
 
-        for (int i = vocab.token_beg; i < n_logits; i++) {
-            if (probs[i] == -INFINITY) {
-                continue;
+            whisper_process_logits(*ctx_draft, sd, params, dd, 0, 0.0f);
+
+            const auto token = whisper_sample_token(*ctx_draft, sd, dd, true);
+
+            batch.push_back(token.id);
+            stream.push_back(token.id);
+
+            dd.sequence.tokens.push_back(token);
+
+            if (token.id > whisper_token_beg(ctx_draft)) {
+                dd.has_ts     = true;
+                dd.seek_delta = 2*(token.id - whisper_token_beg(ctx_draft));
             }
 
-            sum_ts += probs[i];
-            if (max_ts < probs[i]) {
-                max_ts = probs[i];
-                result.tid = i;
+            if (token.id == whisper_token_eot(ctx_draft)) {
+                break;
             }
         }
 
-        result.pt    = max_ts/(sum_ts + 1e-10);
-        result.ptsum = sum_ts;
+        return true;
     }
 
-    if (best) {
-        for (int i = 0; i < n_logits; ++i) {
-            if (result.p < probs[i]) {
-                result.id   = i;
-                result.p    = probs[i];
-                result.plog = logprobs[i];
+    // evaluate the last sampled token of the decoder and process the logits for the next one
+    bool decode(const whisper_full_params & params, whisper_decoder & decoder, const std::vector<whisper_token> & prompt, int seek_cur, float t_cur) {
+        const whisper_token id = decoder.sequence.tokens.back().id;
+
+        if (i_batch + 1 < (int) batch.size() && batch[i_batch + 1] == id) {
+            // the draft model proposed this token - it is already in the KV cache and its logits are known
+            ++i_batch;
+        } else {
+            if (!propose(params, decoder, prompt, seek_cur)) {
+                return false;
             }
-        }
-    } else {
-        std::discrete_distribution<> dist(probs.begin(), probs.end());
 
-        result.id   = dist(state.rng);
-        result.p    = probs[result.id];
-        result.plog = logprobs[result.id];
-    }
+            whisper_decoder * decoders[1] = { &decoder };
 
-    if (result.id >= vocab.token_beg) {
-        result.tid = result.id;
-        result.pt  = result.p;
-    }
+            const int n_past = decoder.kv_self.n;
 
-    state.n_sample++;
+            if (!whisper_decode_batch_internal(ctx, state, decoders, batch.data(), batch.size(), &n_past, 1, params.n_threads, true)) {
+                return false;
+            }
 
-    return result;
-}
+            i_batch = 0;
+        }
 
-static std::vector<whisper_token_data> whisper_sample_token_topk(
-            whisper_context & ctx,
-              whisper_state & state,
-      const whisper_decoder & decoder,
-                        int   k) {
-    const auto & vocab = ctx.vocab;
+        const int64_t t_start_sample_us = ggml_time_us();
 
-    const auto & probs    = decoder.probs;
-    const auto & logits   = decoder.logits;
-    const auto & logprobs = decoder.logprobs;
+        whisper_process_logits(ctx, state, params, decoder, i_batch, t_cur);
 
-    const int n_logits = vocab.n_vocab;
+        ++decoder.kv_self.n;
 
-    auto & logits_id = state.logits_id;
+        state.t_sample_us += ggml_time_us() - t_start_sample_us;
 
-    logits_id.clear();
-    for (int i = 0; i < n_logits; ++i) {
-        logits_id.push_back({ logits[i], i });
+        return true;
     }
+};
 
-    std::partial_sort(
-            logits_id.begin(),
-            logits_id.begin() + k, logits_id.end(),
-            [](const std::pair<double, whisper_token> & a, const std::pair<double, whisper_token> & b) {
-                return a.first > b.first;
-            });
+// [EXPERIMENTAL] decode scheduler for concurrent whisper_full_with_state() calls (see whisper_scheduler_init)
+//
+// each call submits the decode step of its decoders and waits. the first waiting call that finds no pass in progress
+// evaluates all pending steps in a single batched pass, with the buffers of its state and the threads of all of them,
+// and hands each state the logits of its decoders - the steps submitted during a pass are evaluated by the next one,
+// so the calls join and leave the batch between steps
+struct whisper_sched_step {
+    whisper_state * state;
+
+    whisper_decoder    ** decoders;
+    const whisper_token * tokens;
+    const int           * n_past;
+
+    int n_batch;
+    int n_threads;
+
+    bool done = false;
+    bool ok   = false;
+};
 
-    std::vector<whisper_token_data> result;
-    result.reserve(k);
+struct whisper_scheduler {
+    whisper_context * ctx = nullptr;
 
-    whisper_token tid = vocab.token_beg;
+    std::mutex              mutex;
+    std::condition_variable cv;
 
-    float pt    = 0.0;
-    float ptsum = 0.0;
+    bool busy = false; // a pass is in progress
 
-    {
-        double sum_ts = 0.0;
-        double max_ts = 0.0;
+    std::vector<whisper_sched_step *> pending;
+};
 
-        for (int i = vocab.token_beg; i < n_logits; i++) {
-            if (probs[i] == -INFINITY) {
-                continue;
-            }
+struct whisper_scheduler * whisper_scheduler_init(struct whisper_context * ctx) {
+    whisper_scheduler * sched = new whisper_scheduler;
 
-            sum_ts += probs[i];
-            if (max_ts < probs[i]) {
-                max_ts = probs[i];
-                tid = i;
-            }
-        }
+    sched->ctx = ctx;
 
-        pt    = max_ts/(sum_ts + 1e-10);
-        ptsum = sum_ts;
-    }
+    return sched;
+}
 
-    for (int i = 0; i < k; ++i) {
-        const auto id = logits_id[i].second;
+void whisper_scheduler_free(struct whisper_scheduler * sched) {
+    if (sched) {
+        WHISPER_ASSERT(sched->pending.empty() && !sched->busy);
 
-        result.push_back({ id, tid, probs[id], logprobs[id], pt, ptsum, -1, -1, 0.0f, });
+        delete sched;
+    }
+}
 
-        if (result[i].id >= vocab.token_beg) {
-            result[i].tid = result[i].id;
-            result[i].pt  = result[i].p;
+// evaluate the steps in one pass with the buffers of wstate
+static bool whisper_sched_run(whisper_context & ctx, whisper_state & wstate, const std::vector<whisper_sched_step *> & steps) {
+    std::vector<whisper_state *>   states;
+    std::vector<whisper_decoder *> decoders;
+    std::vector<whisper_token>     tokens;
+    std::vector<int>               n_past;
+
+    int n_threads = 0;
+
+    for (const auto * step : steps) {
+        for (int b = 0; b < step->n_batch; ++b) {
+            states  .push_back(step->state);
+            decoders.push_back(step->decoders[b]);
+            tokens  .push_back(step->tokens[b]);
+            n_past  .push_back(step->n_past[b]);
         }
+
+        n_threads += step->n_threads;
     }
 
-    state.n_sample++;
+    n_threads = std::max(1, std::min(n_threads, (int) std::thread::hardware_concurrency()));
 
-    return result;
-}
+    const int64_t t_start_us = ggml_time_us();
 
-// ref: https://github.com/openai/whisper/blob/0b1ba3d46ebf7fe6f953acfd8cad62a4f851b49f/whisper/decoding.py#L178-L192
-static void whisper_sequence_score(
-        const struct whisper_full_params & params,
-                        whisper_sequence & sequence) {
-    if (sequence.result_len == 0) {
-        return;
+    if (!whisper_decode_batch_internal(ctx, wstate, states.data(), decoders.data(), tokens.data(), 1, n_past.data(), states.size(), n_threads, false)) {
+        return false;
     }
 
-    double result = 0.0f;
+    const int64_t t_decode_us = ggml_time_us() - t_start_us;
 
-    for (int i = 0; i < sequence.result_len; ++i) {
-        result += sequence.tokens[i].plog;
-    }
+    const int n_vocab = ctx.vocab.n_vocab;
 
-    sequence.sum_logprobs = result;
-    sequence.avg_logprobs = result/sequence.result_len;
+    std::vector<float> logits;
+    logits.swap(wstate.logits);
 
-    double penalty = sequence.result_len;
+    int i0 = 0;
+    for (auto * step : steps) {
+        auto & state = *step->state;
 
-    if (params.length_penalty > 0.0f) {
-        penalty = pow((5.0 + penalty)/6.0, params.length_penalty);
+        state.logits.assign(logits.begin() + (size_t) i0*n_vocab, logits.begin() + (size_t) (i0 + step->n_batch)*n_vocab);
+
+        // the other states spent the pass waiting for it
+        if (&state != &wstate) {
+            state.t_decode_us += t_decode_us;
+            state.n_decode++;
+        }
+
+        i0 += step->n_batch;
     }
 
-    sequence.score = result/penalty;
+    return true;
+}
 
-    // compute the entropy of the sequence of the last 32 tokens
-    {
-        const int n = 32;
+// decode the next token of the decoders of a state together with the pending steps of the other states
+// the logits are stored in state.logits [n_batch][n_vocab], as with whisper_decode_batch_internal()
+static bool whisper_sched_decode(
+      whisper_scheduler & sched,
+          whisper_state & state,
+      whisper_decoder ** decoders,
+    const whisper_token * tokens,
+              const int * n_past,
+              const int   n_batch,
+              const int   n_threads) {
+    whisper_sched_step step;
 
-        int cnt = 0;
-        double entropy = 0.0f;
+    step.state     = &state;
+    step.decoders  = decoders;
+    step.tokens    = tokens;
+    step.n_past    = n_past;
+    step.n_batch   = n_batch;
+    step.n_threads = n_threads;
 
-        std::map<whisper_token, int> token_counts;
-        for (int i = std::max(0, sequence.result_len - n); i < sequence.result_len; ++i) {
-            token_counts[sequence.tokens[i].id]++;
-            cnt++;
+    std::unique_lock<std::mutex> lock(sched.mutex);
+
+    sched.pending.push_back(&step);
+
+    while (!step.done) {
+        if (sched.busy) {
+            sched.cv.wait(lock);
+            continue;
         }
 
-        for (const auto & kv : token_counts) {
-            const auto p = kv.second/(double)cnt;
-            entropy -= p*log(p);
+        std::vector<whisper_sched_step *> steps;
+        steps.swap(sched.pending);
 
-            //WHISPER_PRINT_DEBUG("entropy: %d %f %f, count %d\n", kv.first, p, log(p), kv.second);
+        sched.busy = true;
+        lock.unlock();
+
+        const bool ok = whisper_sched_run(*sched.ctx, state, steps);
+
+        lock.lock();
+        sched.busy = false;
+
+        for (auto * s : steps) {
+            s->ok   = ok;
+            s->done = true;
         }
 
-        sequence.entropy = entropy;
+        sched.cv.notify_all();
     }
+
+    return step.ok;
 }
 
 int whisper_full_with_state(
@@ -3906,6 +5728,18 @@ int whisper_full_with_state(
         }
     }
 
+    // overwrite audio_ctx, max allowed is hparams.n_audio_ctx
+    // (set before the language detection, so that it does not use the context of a previous call)
+    if (params.audio_ctx > whisper_n_audio_ctx(ctx)) {
+        Rprintf("%s: audio_ctx is larger than the maximum allowed (%d > %d)\n", __func__, params.audio_ctx, whisper_n_audio_ctx(ctx));
+        return -5;
+    }
+    state->exp_n_audio_ctx = std::max(0, params.audio_ctx);
+    state->exp_stem_reuse  = params.stem_reuse;
+
+    // the language detection needs the logits of the language tokens - the vocabulary is restricted below
+    state->exp_vocab_allowed.clear();
+
     // auto-detect language if not specified
     if (params.language == nullptr || strlen(params.language) == 0 || strcmp(params.language, "auto") == 0 || params.detect_language) {
         std::vector<float> probs(whisper_lang_max_id() + 1, 0.0f);
@@ -3931,6 +5765,28 @@ int whisper_full_with_state(
         state->energy = get_signal_energy(samples, n_samples, 32);
     }
 
+    // [EXPERIMENTAL] restricted vocabulary
+    if (params.allowed_tokens != nullptr && params.n_allowed_tokens > 0) {
+        auto & allowed = state->exp_vocab_allowed;
+
+        allowed.assign(params.allowed_tokens, params.allowed_tokens + params.n_allowed_tokens);
+        allowed.push_back(whisper_token_eot(ctx));
+
+        // the timestamp tokens delimit the segments and the seek of the next window
+        for (whisper_token id = whisper_token_beg(ctx); id < whisper_n_vocab(ctx); ++id) {
+            allowed.push_back(id);
+        }
+
+        std::sort(allowed.begin(), allowed.end());
+        allowed.erase(std::unique(allowed.begin(), allowed.end()), allowed.end());
+
+        if (allowed.front() < 0 || allowed.back() >= whisper_n_vocab(ctx)) {
+            Rprintf("%s: allowed token out of range [0, %d)\n", __func__, whisper_n_vocab(ctx));
+            allowed.clear();
+            return -9;
+        }
+    }
+
     const int seek_start = params.offset_ms/10;
     const int seek_end = params.duration_ms == 0 ? whisper_n_len_from_state(state) : seek_start + params.duration_ms/10;
 
@@ -3941,6 +5797,20 @@ int whisper_full_with_state(
         return 0;
     }
 
+    // [EXPERIMENTAL] size the audio context to the length of the audio
+    // each encoder position covers 2 mel frames - add a margin and round up so that the context is never tight
+    // if the decoding of the reduced context is not confident enough, the window is re-encoded with the full context
+    bool audio_ctx_auto = false;
+    if (params.audio_ctx < 0) {
+        const int n_audio_ctx = whisper_n_audio_ctx(ctx);
+        const int n_ctx_auto  = (((seek_end - seek_start)/2 + 128 + 63)/64)*64;
+
+        if (n_ctx_auto < n_audio_ctx) {
+            state->exp_n_audio_ctx = n_ctx_auto;
+            audio_ctx_auto = true;
+        }
+    }
+
     // a set of temperatures to use
     // [ t0, t0 + delta, t0 + 2*delta, ..., < 1.0f + 1e-6f ]
     std::vector<float> temperatures;
@@ -3972,20 +5842,11 @@ int whisper_full_with_state(
     for (int j = 1; j < n_decoders; j++) {
         auto & decoder = state->decoders[j];
 
-        if (decoder.kv_self.ctx == nullptr) {
-            decoder.kv_self = state->decoders[0].kv_self;
-            if (!kv_cache_reinit(decoder.kv_self)) {
-                Rprintf("%s: kv_cache_reinit() failed for self-attention, decoder %d\n", __func__, j);
-                return -4;
-            }
-
-            WHISPER_PRINT_DEBUG("%s: initialized self-attention kv cache, decoder %d\n", __func__, j);
+        // the logits buffers are allocated by whisper_process_logits() when the decoder processes its first token
+        if (decoder.sequence.tokens.capacity() == 0) {
+            WHISPER_PRINT_DEBUG("%s: initialized decoder %d\n", __func__, j);
 
             decoder.sequence.tokens.reserve(state->decoders[0].sequence.tokens.capacity());
-
-            decoder.probs.resize   (ctx->vocab.n_vocab);
-            decoder.logits.resize  (ctx->vocab.n_vocab);
-            decoder.logprobs.resize(ctx->vocab.n_vocab);
         }
     }
 
@@ -4017,13 +5878,6 @@ int whisper_full_with_state(
         }
     }
 
-    // overwrite audio_ctx, max allowed is hparams.n_audio_ctx
-    if (params.audio_ctx > whisper_n_audio_ctx(ctx)) {
-        Rprintf("%s: audio_ctx is larger than the maximum allowed (%d > %d)\n", __func__, params.audio_ctx, whisper_n_audio_ctx(ctx));
-        return -5;
-    }
-    state->exp_n_audio_ctx = params.audio_ctx;
-
     // these tokens determine the task that will be performed
     std::vector<whisper_token> prompt_init = { whisper_token_sot(ctx) };
     if (whisper_is_multilingual(ctx)) {
@@ -4037,6 +5891,45 @@ int whisper_full_with_state(
         }
     }
 
+    // size the self-attention KV cache for the decoders of this call - the decoders share the blocks of the prompt
+    // and each of them generates at most n_gen tokens (the cache grows if a decoder needs more)
+    {
+        const int n_text_ctx = whisper_n_text_ctx(ctx);
+        const int n_prompt   = (params.n_max_text_ctx > 0 ? 1 + std::min(params.n_max_text_ctx, n_text_ctx/2) : 0) + prompt_init.size();
+
+        int n_gen = n_text_ctx/2 - 4;
+        if (params.max_tokens > 0) {
+            n_gen = std::min(n_gen, params.max_tokens + 1);
+        }
+        if (params.draft_ctx != nullptr) {
+            n_gen += std::max(0, params.draft_n_tokens);
+        }
+        n_gen = std::max(0, std::min(n_gen, n_text_ctx - n_prompt));
+
+        // one more block per decoder for the copy of its partially filled block of the prompt (copy-on-write)
+        const int n_block = kv_pool_n_block(n_prompt) + n_decoders*kv_pool_n_block(n_gen) + (n_decoders > 1 ? n_decoders : 0);
+
+        // the decoders of the previous call release their blocks and the unused decoders their buffers
+        for (int j = 0; j < WHISPER_MAX_DECODERS; ++j) {
+            auto & decoder = state->decoders[j];
+
+            kv_pages_release(state->kv_pool, decoder.kv_self);
+
+            if (j >= n_decoders) {
+                std::vector<whisper_token_data>().swap(decoder.sequence.tokens);
+
+                std::vector<float>().swap(decoder.probs);
+                std::vector<float>().swap(decoder.logits);
+                std::vector<float>().swap(decoder.logprobs);
+            }
+        }
+
+        if (!kv_pool_resize(ctx->model.hparams, state->kv_pool, n_block)) {
+            Rprintf("%s: kv_pool_resize() failed for self-attention, %d decoders\n", __func__, n_decoders);
+            return -4;
+        }
+    }
+
     int progress_prev = 0;
     int progress_step = 5;
 
@@ -4046,12 +5939,7 @@ int whisper_full_with_state(
     prompt.reserve(whisper_n_text_ctx(ctx));
 
     // beam-search helpers
-    struct kv_buf {
-        std::vector<uint8_t> k;
-        std::vector<uint8_t> v;
-    };
-
-    std::vector<kv_buf> kv_bufs;
+    std::vector<whisper_kv_pages> kv_bufs; // page tables of the decoders before the beam-search step
 
     struct beam_candidate {
         int decoder_idx;
@@ -4064,6 +5952,21 @@ int whisper_full_with_state(
 
     std::vector<beam_candidate> beam_candidates;
 
+    // batched decoding helpers
+    std::vector<whisper_decoder *> batch_decoders;
+    std::vector<whisper_token>     batch_tokens;
+    std::vector<int>               batch_n_past;
+
+    whisper_encode_ahead ahead(*ctx, *state);
+    whisper_speculative  spec (*ctx, *state, params);
+
+    // [EXPERIMENTAL] continuous batching with the concurrent calls that use the same scheduler
+    whisper_scheduler * sched = params.scheduler;
+    if (sched != nullptr && sched->ctx != ctx) {
+        Rprintf("%s: the scheduler belongs to a different model - decoding without it\n", __func__);
+        sched = nullptr;
+    }
+
     // main loop
     while (true) {
         const int progress_cur = (100*(seek - seek_start))/(seek_end - seek_start);
@@ -4090,12 +5993,22 @@ int whisper_full_with_state(
             }
         }
 
-        // encode audio features starting at offset seek
-        if (!whisper_encode_internal(*ctx, *state, seek, params.n_threads)) {
+        // encode audio features starting at offset seek (unless they were encoded ahead)
+        if (!ahead.take(seek) && !whisper_encode_internal(*ctx, *state, seek, params.n_threads)) {
             Rprintf("%s: failed to encode\n", __func__);
             return -6;
         }
 
+        if (spec.enabled() && !spec.encode(seek, params.n_threads)) {
+            Rprintf("%s: failed to encode with the draft model\n", __func__);
+            return -6;
+        }
+
+        // start on the next window while this one is decoded
+        if (params.n_threads_ahead > 0 && seek + 100*WHISPER_CHUNK_SIZE + 100 < seek_end) {
+            ahead.start(seek + 100*WHISPER_CHUNK_SIZE, params.n_threads_ahead);
+        }
+
         // if there is a very short audio segment left to process, we remove any past prompt since it tends
         // to confuse the decoder and often make it repeat or hallucinate stuff
         if (seek > seek_start && seek + 500 >= seek_end) {
@@ -4128,13 +6041,19 @@ int whisper_full_with_state(
 
             n_decoders_cur = std::max(1, n_decoders_cur);
 
+            // speculative decoding reproduces the greedy choices of a single decoder
+            const bool use_spec = spec.enabled() && n_decoders_cur == 1 && t_cur < 1e-6f &&
+                params.strategy == whisper_sampling_strategy::WHISPER_SAMPLING_GREEDY;
+
+            spec.reset();
+
             WHISPER_PRINT_DEBUG("\n%s: decoding with %d decoders, temperature = %.2f\n", __func__, n_decoders_cur, t_cur);
 
             // TAGS: WHISPER_DECODER_INIT
             for (int j = 0; j < n_decoders_cur; ++j) {
                 auto & decoder = state->decoders[j];
 
-                decoder.kv_self.n = 0;
+                kv_pages_release(state->kv_pool, decoder.kv_self);
 
                 decoder.sequence.tokens.clear();
                 decoder.sequence.result_len       = 0;
@@ -4174,7 +6093,7 @@ int whisper_full_with_state(
                 }
                 WHISPER_PRINT_DEBUG("\n\n");
 
-                if (!whisper_decode_internal(*ctx, *state, state->decoders[0], prompt.data(), prompt.size(), 0, params.n_threads)) {
+                if (!whisper_decode_internal(*ctx, *state, state->decoders[0], prompt.data(), prompt.size(), 0, params.n_threads, false)) {
                     Rprintf("%s: failed to decode\n", __func__);
                     return -7;
                 }
@@ -4182,21 +6101,17 @@ int whisper_full_with_state(
                 {
                     const int64_t t_start_sample_us = ggml_time_us();
 
-                    whisper_process_logits(*ctx, *state, params, state->decoders[0], t_cur);
+                    whisper_process_logits(*ctx, *state, params, state->decoders[0], 0, t_cur);
 
                     state->decoders[0].kv_self.n += prompt.size();
 
+                    // the other decoders share the blocks of the prompt and sample their first token from the
+                    // distribution of decoder 0 - see below
                     for (int j = 1; j < n_decoders_cur; ++j) {
                         auto & decoder = state->decoders[j];
 
-                        memcpy(decoder.kv_self.k->data, state->decoders[0].kv_self.k->data, ggml_nbytes(decoder.kv_self.k));
-                        memcpy(decoder.kv_self.v->data, state->decoders[0].kv_self.v->data, ggml_nbytes(decoder.kv_self.v));
-
-                        decoder.kv_self.n += prompt.size();
-
-                        memcpy(decoder.probs.data(), state->decoders[0].probs.data(),    decoder.probs.size()*sizeof(decoder.probs[0]));
-                        memcpy(decoder.logits.data(), state->decoders[0].logits.data(),   decoder.logits.size()*sizeof(decoder.logits[0]));
-                        memcpy(decoder.logprobs.data(), state->decoders[0].logprobs.data(), decoder.logprobs.size()*sizeof(decoder.logprobs[0]));
+                        decoder.kv_self = state->decoders[0].kv_self;
+                        kv_pages_retain(state->kv_pool, decoder.kv_self);
                     }
 
                     state->t_sample_us += ggml_time_us() - t_start_sample_us;
@@ -4206,7 +6121,8 @@ int whisper_full_with_state(
             for (int i = 0, n_max = whisper_n_text_ctx(ctx)/2 - 4; i < n_max; ++i) {
                 const int64_t t_start_sample_us = ggml_time_us();
 
-                // store the KV caches of all decoders when doing beam-search
+                // store the page tables of all decoders when doing beam-search
+                // the blocks stay in the cache as long as a page table refers to them
                 if (params.strategy == whisper_sampling_strategy::WHISPER_SAMPLING_BEAM_SEARCH) {
                     kv_bufs.resize(n_decoders_cur);
                     for (int j = 0; j < n_decoders_cur; ++j) {
@@ -4216,11 +6132,8 @@ int whisper_full_with_state(
                             continue;
                         }
 
-                        kv_bufs[j].k.resize(ggml_nbytes(decoder.kv_self.k));
-                        kv_bufs[j].v.resize(ggml_nbytes(decoder.kv_self.v));
-
-                        memcpy(kv_bufs[j].k.data(), decoder.kv_self.k->data, kv_bufs[j].k.size());
-                        memcpy(kv_bufs[j].v.data(), decoder.kv_self.v->data, kv_bufs[j].v.size());
+                        kv_bufs[j] = decoder.kv_self;
+                        kv_pages_retain(state->kv_pool, kv_bufs[j]);
                     }
 
                     beam_candidates.clear();
@@ -4234,20 +6147,23 @@ int whisper_full_with_state(
                         continue;
                     }
 
+                    // right after the prompt, all decoders have the logits of decoder 0
+                    const auto & decoder_logits = i == 0 ? state->decoders[0] : decoder;
+
                     switch (params.strategy) {
                         case whisper_sampling_strategy::WHISPER_SAMPLING_GREEDY:
                             {
                                 if (t_cur < 1e-6f) {
-                                    decoder.sequence.tokens.push_back(whisper_sample_token(*ctx, *state, decoder, true));
+                                    decoder.sequence.tokens.push_back(whisper_sample_token(*ctx, *state, decoder_logits, true));
                                 } else {
-                                    decoder.sequence.tokens.push_back(whisper_sample_token(*ctx, *state, decoder, false));
+                                    decoder.sequence.tokens.push_back(whisper_sample_token(*ctx, *state, decoder_logits, false));
                                 }
 
                                 decoder.sequence.sum_logprobs_all += decoder.sequence.tokens.back().plog;
                             } break;
                         case whisper_sampling_strategy::WHISPER_SAMPLING_BEAM_SEARCH:
                             {
-                                const auto tokens_new = whisper_sample_token_topk(*ctx, *state, decoder, params.beam_search.beam_size);
+                                const auto tokens_new = whisper_sample_token_topk(*ctx, *state, decoder_logits, params.beam_search.beam_size);
 
                                 for (const auto & token : tokens_new) {
                                     beam_candidates.push_back({ j, decoder.seek_delta, decoder.has_ts, decoder.sequence });
@@ -4288,12 +6204,18 @@ int whisper_full_with_state(
                         decoder.seek_delta = cur.seek_delta;
                         decoder.has_ts     = cur.has_ts;
 
-                        memcpy(decoder.kv_self.k->data, kv_bufs[cur.decoder_idx].k.data(), kv_bufs[cur.decoder_idx].k.size());
-                        memcpy(decoder.kv_self.v->data, kv_bufs[cur.decoder_idx].v.data(), kv_bufs[cur.decoder_idx].v.size());
+                        // continue from the history of the candidate - its blocks are copied only when written to
+                        kv_pages_release(state->kv_pool, decoder.kv_self);
+                        decoder.kv_self = kv_bufs[cur.decoder_idx];
+                        kv_pages_retain(state->kv_pool, decoder.kv_self);
 
                         WHISPER_PRINT_DEBUG("%s: beam search: decoder %d: from decoder %d: token = %10s, plog = %8.5f, sum_logprobs = %8.5f\n",
                                 __func__, j, cur.decoder_idx, ctx->vocab.id_to_token.at(decoder.sequence.tokens.back().id).c_str(), decoder.sequence.tokens.back().plog, decoder.sequence.sum_logprobs_all);
                     }
+
+                    for (auto & kv_buf : kv_bufs) {
+                        kv_pages_release(state->kv_pool, kv_buf);
+                    }
                 }
 
                 // update the decoder state
@@ -4400,19 +6322,36 @@ int whisper_full_with_state(
                 state->t_sample_us += ggml_time_us() - t_start_sample_us;
 
                 // obtain logits for the next token
-                for (int j = 0; j < n_decoders_cur; ++j) {
-                    auto & decoder = state->decoders[j];
-
-                    if (decoder.failed || decoder.completed) {
-                        continue;
+                // all decoders that are still running are evaluated together in a single batch
+                if (use_spec) {
+                    if (!spec.decode(params, state->decoders[0], prompt, seek, t_cur)) {
+                        Rprintf("%s: failed to decode\n", __func__);
+                        return -8;
                     }
+                } else {
+                    batch_decoders.clear();
+                    batch_tokens.clear();
+                    batch_n_past.clear();
+
+                    for (int j = 0; j < n_decoders_cur; ++j) {
+                        auto & decoder = state->decoders[j];
+
+                        if (decoder.failed || decoder.completed) {
+                            continue;
+                        }
+
+                        //WHISPER_PRINT_DEBUG("%s: decoder %d: token %d, kv_self.n %d, seek_delta %d\n", __func__, j, decoder.sequence.tokens.back().id, decoder.kv_self.n, decoder.seek_delta);
 
-                    decoder.tokens_tmp.resize(1);
-                    decoder.tokens_tmp[0] = decoder.sequence.tokens.back().id;
+                        batch_decoders.push_back(&decoder);
+                        batch_tokens.push_back(decoder.sequence.tokens.back().id);
+                        batch_n_past.push_back(decoder.kv_self.n);
+                    }
 
-                    //WHISPER_PRINT_DEBUG("%s: decoder %d: token %d, kv_self.n %d, seek_delta %d\n", __func__, j, decoder.tokens_tmp[0], decoder.kv_self.n, decoder.seek_delta);
+                    const bool ok = sched != nullptr
+                        ? whisper_sched_decode(*sched, *state, batch_decoders.data(), batch_tokens.data(), batch_n_past.data(), batch_decoders.size(), params.n_threads)
+                        : whisper_decode_batch_internal(*ctx, *state, batch_decoders.data(), batch_tokens.data(), 1, batch_n_past.data(), batch_decoders.size(), params.n_threads, false);
 
-                    if (!whisper_decode_internal(*ctx, *state, decoder, decoder.tokens_tmp.data(), decoder.tokens_tmp.size(), decoder.kv_self.n, params.n_threads)) {
+                    if (!ok) {
                         Rprintf("%s: failed to decode\n", __func__);
                         return -8;
                     }
@@ -4420,9 +6359,13 @@ int whisper_full_with_state(
                     {
                         const int64_t t_start_sample_us = ggml_time_us();
 
-                        whisper_process_logits(*ctx, *state, params, decoder, t_cur);
+                        for (int b = 0; b < (int) batch_decoders.size(); ++b) {
+                            auto & decoder = *batch_decoders[b];
+
+                            whisper_process_logits(*ctx, *state, params, decoder, b, t_cur);
 
-                        ++decoder.kv_self.n;
+                            ++decoder.kv_self.n;
+                        }
 
                         state->t_sample_us += ggml_time_us() - t_start_sample_us;
                     }
@@ -4465,6 +6408,35 @@ int whisper_full_with_state(
                 WHISPER_PRINT_DEBUG("%s: best decoder = %d\n", __func__, best_decoder_id);
             }
 
+            // the reduced audio context was not good enough - encode the window again with the full context
+            // and decode it at the same temperature, before falling back to higher temperatures
+            if (audio_ctx_auto) {
+                const auto & decoder = state->decoders[best_decoder_id];
+
+                if (decoder.failed || decoder.sequence.avg_logprobs < params.logprob_thold) {
+                    WHISPER_PRINT_DEBUG("%s: falling back to the full audio context (audio_ctx = %d)\n", __func__, state->exp_n_audio_ctx);
+
+                    state->exp_n_audio_ctx = 0;
+                    audio_ctx_auto = false;
+
+                    // the window encoded ahead has the reduced context - wait for it to return the spectrogram
+                    ahead.join();
+
+                    if (!whisper_encode_internal(*ctx, *state, seek, params.n_threads)) {
+                        Rprintf("%s: failed to encode\n", __func__);
+                        return -6;
+                    }
+
+                    if (spec.enabled() && !spec.encode(seek, params.n_threads)) {
+                        Rprintf("%s: failed to encode with the draft model\n", __func__);
+                        return -6;
+                    }
+
+                    --it;
+                    continue;
+                }
+            }
+
             // was the decoding successful for the current temperature?
             // do fallback only if:
             // - we are not at the last temperature
@@ -67,6 +67,7 @@ extern "C" {
 
     struct whisper_context;
     struct whisper_state;
+    struct whisper_scheduler;
 
     typedef int whisper_token;
 
@@ -163,6 +164,30 @@ extern "C" {
                                int   n_len,
                                int   n_mel);
 
+    // [EXPERIMENTAL] Cache the results of whisper_pcm_to_mel() and whisper_encode() for repeated audio
+    // Entries are keyed by a hash of the PCM samples and the front-end parameters and evicted in LRU order
+    // n_mel:    max number of cached mel spectrograms (0 - disabled, default)
+    // n_encode: max number of cached encoder windows, i.e. cross-attention KV caches (0 - disabled, default)
+    WHISPER_API void whisper_set_cache(
+            struct whisper_context * ctx,
+                               int   n_mel,
+                               int   n_encode);
+
+    WHISPER_API void whisper_set_cache_with_state(
+            struct whisper_context * ctx,
+              struct whisper_state * state,
+                               int   n_mel,
+                               int   n_encode);
+
+    // [EXPERIMENTAL] Store the cross-attention KV cache with 8-bit block quantization (Q8_0) instead of F16
+    // This halves its memory and the data that the decoder reads for every token, at a small cost in accuracy
+    // Applies to the default state and to the states created afterwards.
+    // The encoder output held by the default state and its cached encoder windows are discarded
+    // Returns 0 on success
+    WHISPER_API int whisper_set_kv_cross_q8(
+            struct whisper_context * ctx,
+                              bool   enable);
+
     // Run the Whisper encoder on the log mel spectrogram stored inside the default state in the provided whisper context.
     // Make sure to call whisper_pcm_to_mel() or whisper_set_mel() first.
     // offset can be used to specify the offset of the first frame in the spectrogram.
@@ -178,6 +203,75 @@ extern "C" {
                                int   offset,
                                int   n_threads);
 
+    // [EXPERIMENTAL] Run the Whisper encoder on several windows of the log mel spectrogram in a single batched graph.
+    // The output of the first window is used by the decoder, the same as with whisper_encode().
+    // The output of the other windows is stored in the encoder cache, so that encoding them later costs only a copy.
+    // The encoder cache must hold at least n_offsets windows - call whisper_set_cache() before whisper_pcm_to_mel().
+    // Returns 0 on success
+    WHISPER_API int whisper_encode_batch(
+            struct whisper_context * ctx,
+                         const int * offsets,
+                               int   n_offsets,
+                               int   n_threads);
+
+    WHISPER_API int whisper_encode_batch_with_state(
+            struct whisper_context * ctx,
+              struct whisper_state * state,
+                         const int * offsets,
+                               int   n_offsets,
+                               int   n_threads);
+
+    // [EXPERIMENTAL] Save the output of the last encoded window (the cross-attention KV cache) to a file,
+    // together with the offset and the identity of the audio (if the cache was enabled, see whisper_set_cache())
+    // Returns 0 on success
+    WHISPER_API int whisper_encode_save(
+            struct whisper_context * ctx,
+                        const char * path);
+
+    WHISPER_API int whisper_encode_save_with_state(
+            struct whisper_context * ctx,
+              struct whisper_state * state,
+                        const char * path);
+
+    // [EXPERIMENTAL] Load an encoder output saved with whisper_encode_save(), so that the window can be decoded
+    // with whisper_decode() without running the encoder.
+    // If the encoder cache is enabled, the window is also added to it, so that whisper_full() on the same audio
+    // (and with the same audio_ctx and stem_reuse) skips the encoder for it.
+    // Returns 0 on success
+    WHISPER_API int whisper_encode_load(
+            struct whisper_context * ctx,
+                        const char * path);
+
+    WHISPER_API int whisper_encode_load_with_state(
+            struct whisper_context * ctx,
+              struct whisper_state * state,
+                        const char * path);
+
+    // [EXPERIMENTAL] Run only the encoder and return its hidden states, e.g. for use as audio embeddings.
+    // Make sure to call whisper_pcm_to_mel() or whisper_set_mel() first.
+    // layer selects the encoder block to take the output of (0 .. whisper_model_n_audio_layer() - 1),
+    // or -1 for the final normalized output. The blocks after it and the cross-attention KV cache are not computed.
+    // audio_ctx is the number of encoder positions to compute (0 = the full 30 second window).
+    // out must hold n_ctx*whisper_model_n_audio_state() floats. It is written as n_ctx rows of n_audio_state values.
+    // If out is NULL, the output is left in the state instead (see whisper_get_features()).
+    // Returns the number of rows written (n_ctx), or -1 on failure
+    WHISPER_API int whisper_encode_features(
+            struct whisper_context * ctx,
+                               int   offset,
+                               int   layer,
+                               int   audio_ctx,
+                             float * out,
+                               int   n_threads);
+
+    WHISPER_API int whisper_encode_features_with_state(
+            struct whisper_context * ctx,
+              struct whisper_state * state,
+                               int   offset,
+                               int   layer,
+                               int   audio_ctx,
+                             float * out,
+                               int   n_threads);
+
     // Run the Whisper decoder to obtain the logits and probabilities for the next token.
     // Make sure to call whisper_encode() first.
     // tokens + n_tokens is the provided context for the decoder.
@@ -268,6 +362,13 @@ extern "C" {
     WHISPER_API float * whisper_get_logits           (struct whisper_context * ctx);
     WHISPER_API float * whisper_get_logits_from_state(struct whisper_state * state);
 
+    // [EXPERIMENTAL] Encoder output obtained from the last call to whisper_encode_features()
+    // Valid until the next call that uses the state
+    // Rows: n_ctx
+    // Cols: n_audio_state
+    WHISPER_API const float * whisper_get_features           (struct whisper_context * ctx);
+    WHISPER_API const float * whisper_get_features_from_state(struct whisper_state * state);
+
     // Token Id -> String. Uses the vocabulary in the provided context
     WHISPER_API const char * whisper_token_to_str(struct whisper_context * ctx, whisper_token token);
     WHISPER_API const char * whisper_model_type_readable(struct whisper_context * ctx);
@@ -355,7 +456,22 @@ extern "C" {
         // [EXPERIMENTAL] speed-up techniques
         // note: these can significantly reduce the quality of the output
         bool speed_up;          // speed-up the audio by 2x using Phase Vocoder
-        int  audio_ctx;         // overwrite the audio context size (0 = use default)
+        int  audio_ctx;         // overwrite the audio context size (0 = use default, -1 = size to the length of the audio)
+        int  n_threads_ahead;   // if > 0, encode the next window on this many extra threads while the current one is decoded
+                                // (does not change the output, but needs a second set of encoder buffers)
+        bool stem_reuse;        // compute the convolutional stem of the encoder once for the overlap of consecutive windows
+                                // (the edges of a window see the neighbouring audio instead of zero padding)
+
+        // [EXPERIMENTAL] speculative decoding
+        // a smaller model with the same vocabulary (e.g. tiny) proposes the next draft_n_tokens tokens, which are
+        // verified with a single pass of this model - only used for greedy decoding at temperature 0
+        // (the output is normally the same as without it - the pass over several tokens sums the logits in a different
+        // order, so where two tokens are within rounding of each other the other one may be picked)
+        struct whisper_context * draft_ctx;
+        int draft_n_tokens;
+
+        // [EXPERIMENTAL] continuous batching of the decode steps of concurrent calls (see whisper_scheduler_init)
+        struct whisper_scheduler * scheduler;
 
         // tokens to provide to the whisper decoder as initial prompt
         // these are prepended to any existing text context from a previous call
@@ -371,6 +487,12 @@ extern "C" {
         bool suppress_blank;    // ref: https://github.com/openai/whisper/blob/f82bc59f5ea234d4b97fb2860842ed38519f7e65/whisper/decoding.py#L89
         bool suppress_non_speech_tokens; // ref: https://github.com/openai/whisper/blob/7858aa9c08d98f75575035ecd6481f462d66ca27/whisper/tokenizer.py#L224-L253
 
+        // [EXPERIMENTAL] restricted vocabulary (e.g. a list of commands or keywords)
+        // the logits are computed only for these tokens, all other tokens are never sampled
+        // the end-of-text and the timestamp tokens are always allowed
+        const whisper_token * allowed_tokens;
+        int n_allowed_tokens;
+
         float temperature;      // initial decoding temperature, ref: https://ai.stackexchange.com/a/32478
         float max_initial_ts;   // ref: https://github.com/openai/whisper/blob/f82bc59f5ea234d4b97fb2860842ed38519f7e65/whisper/decoding.py#L97
         float length_penalty;   // ref: https://github.com/openai/whisper/blob/f82bc59f5ea234d4b97fb2860842ed38519f7e65/whisper/transcribe.py#L267
@@ -439,6 +561,15 @@ extern "C" {
                                    int   n_samples,
                                    int   n_processors);
 
+    // [EXPERIMENTAL] continuous batching of concurrent transcriptions with the same model
+    // whisper_full_with_state() calls that run on different threads, each with its own state, and share a scheduler
+    // through whisper_full_params.scheduler evaluate their decode steps together - a single batched pass over the
+    // weights of the decoder computes the next token of all of them, using the threads of all of them.
+    // A call joins the batch with its first decode step and leaves it when it returns.
+    // The scheduler must outlive the calls that use it.
+    WHISPER_API struct whisper_scheduler * whisper_scheduler_init(struct whisper_context * ctx);
+    WHISPER_API void whisper_scheduler_free(struct whisper_scheduler * sched);
+
     // Number of generated text segments
     // A segment can be a few words, a sentence, or even a paragraph.
     WHISPER_API int whisper_full_n_segments           (struct whisper_context * ctx);